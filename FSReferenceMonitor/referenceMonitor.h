@@ -18,10 +18,34 @@
 #include <linux/fs.h>
 #include <linux/list.h>
 #include <linux/workqueue.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/mutex.h>
+#include <linux/gfp.h>
+#include <linux/fsnotify_backend.h>
+#include <linux/percpu.h>
+#include <linux/jhash.h>
 
 #define MODNAME "reference_monitor"
 #define PERMS 0644
 #define SHA256_DIGEST_SIZE 16
+#define BLK_HASH_BITS 10 //buckets of the (dev, ino) index of the blacklist
+#define MAX_BULK_PATHS 256 //max number of paths accepted by sys_remove_paths_blacklist
+#define MAX_LOG_FILTERS 32 //max number of filters accepted by sys_set_log_filter
+#define BLK_MARK_MASK (FS_DELETE_SELF | FS_MOVE_SELF) //events of the inode marks on the protected objects
+#define LOG_BUF_SIZE (4 * PAGE_SIZE) //a log record with the definitions it needs
+#define LOG_DICT_BITS 8 //buckets of the log dictionary
+#define LOG_DICT_MAX 4096 //strings defined between two reset records
+#define LOG_DICT_VERSION 2
+#define AGGR_BITS 8 //buckets of the aggregation table
+#define AGGR_MAX 1024 //keys aggregated between two flushes of the whole table
+#define AGGR_DEFAULT_INTERVAL 60 //seconds between two summaries
+#define EXE_CACHE_BITS 6 //buckets of the executable path cache
+#define EXE_CACHE_MAX 64 //paths kept by the executable path cache
+#define BLK_MAX_SB 8 //superblocks with rules tracked one by one, the hooks scan all of them
+#define BLOOM_DEFAULT_BITS 16 //log2 of the number of counters of the prefilter (64 KiB)
+#define BLOOM_DEFAULT_HASHES 4
+#define BLOOM_MAX_HASHES 8
 
 static enum rm_state {
     ON,
@@ -30,15 +54,198 @@ static enum rm_state {
     REC_OFF
 };
 
+//operations intercepted by the monitor, one kretprobe each
+enum rm_op {
+    RM_OP_OPEN,
+    RM_OP_CREATE,
+    RM_OP_LINK,
+    RM_OP_UNLINK,
+    RM_OP_SYMLINK,
+    RM_OP_RMDIR,
+    RM_OP_MKDIR,
+    RM_OP_MKNOD,
+    RM_OP_RENAME,
+    RM_OP_SETATTR,
+    RM_NR_OPS
+};
+
+/*A blacklist node is allocated from a dedicated slab cache. The fields read by the hooks
+come first, the fsnotify mark that tracks the protected inode comes last: the node lives as
+long as the mark is attached to the inode and it is freed one RCU grace period after the mark
+has been released, so no counted reference to the dentry or to the mount is kept*/
 typedef struct _node{
-    struct list_head elem; 
-    char* path;
 	unsigned long inode_cod;
-	struct inode* inode_blk;
-	struct dentry* dentry_blk;
+	dev_t dev;
+	unsigned int path_len;
+    unsigned int mnt_off; //length of the mount prefix of path, the rest is the position of the object under the mount root
+    unsigned int root_len; //length of the mount root under the filesystem root, 0 if the mount shows the whole filesystem
+    unsigned int name_slot; //link of name_hnode hashed in rm->blk_names
+    bool name_stale; //renamed, waiting for rm->rename_work to be hashed under the new name
+    unsigned long name_retired; //RCU cookie, the link not hashed is free once its grace period is over
+    struct hlist_node hnode; //link in the (dev, ino) index, unhashed once the node is removed
+    struct hlist_node name_hnode[2]; //links in the name indexes, a rename hashes the node with the other one
+    struct list_head elem; 
+    struct inode* inode_blk; //kept in memory by the mark, valid while the node is hashed
+    char* path; //interned in rm->path_arena, absolute path at insertion time followed by the mount root
+    struct fsnotify_mark fsn_mark; //inode mark of rm->notify_group
+    struct rcu_head rcu;
 
 } node;
 
+/*The paths of the nodes are packed one after the other into pages. A page is released as
+soon as all the paths it contains have been removed (a path longer than a page gets its own
+high order chunk, starting on a page boundary as well)*/
+struct arena_chunk {
+    struct list_head list;
+    unsigned int order;
+    unsigned int used; //bytes handed out from data
+    unsigned int live; //bytes still referenced by some node
+    char data[];
+};
+
+struct path_arena {
+    spinlock_t lock; //taken with bottom halves disabled, paths are released from RCU callbacks
+    struct list_head chunks;
+    struct arena_chunk* current_chunk; //chunk where the next path is appended
+    unsigned long nr_pages;
+    unsigned long live_bytes;
+};
+
+/*Counting Bloom filter over the keys of the rules.
+The hooks read the counters without locks before the index lookup, the writers update them
+under rm->lock. A counter that reaches 255 is never decremented again*/
+struct bloom_stats {
+    unsigned long queries;
+    unsigned long negatives; //lookups skipped
+    unsigned long false_positives; //lookups done for nothing
+};
+
+struct blk_bloom {
+    u8* counters;
+    unsigned int bits; //log2 of the number of counters
+    unsigned int hashes;
+    unsigned long nr_keys;
+    unsigned long nr_set; //counters different from zero
+    struct bloom_stats __percpu *stats;
+};
+
+//number of rules on a superblock, a free slot has sb == NULL
+struct sb_rules {
+    struct super_block* sb;
+    unsigned long nr_rules;
+};
+
+/*filter of sys_set_log_filter as passed by user space: a denial matching every field
+(-1, NULL or 0 stand for any) is not logged. Kept in sync with test/include/client.h*/
+struct log_filter_spec {
+    int uid;
+    int euid;
+    const char __user* exe; //path of the program
+    const char __user* rule; //path of the protected object
+    unsigned int ops; //bitmask of enum rm_op
+};
+
+#define FILTER_UID 0x1
+#define FILTER_EUID 0x2
+#define FILTER_EXE 0x4
+#define FILTER_RULE 0x8
+
+//filter compiled by the system call, the paths resolved to (dev, ino) pairs
+struct log_filter_rule {
+    unsigned int fields; //FILTER_* checked by the rule
+    unsigned int ops;
+    uid_t uid;
+    uid_t euid;
+    dev_t exe_dev;
+    unsigned long exe_ino;
+    dev_t rule_dev;
+    unsigned long rule_ino;
+};
+
+/*set of filters checked by the pre-hooks before anything is prepared for the logger.
+Replaced as a whole, read under RCU*/
+struct log_filter {
+    struct rcu_head rcu;
+    unsigned int ops; //operations having at least one filter
+    unsigned int nr_rules;
+    struct log_filter_rule rules[];
+};
+
+struct log_filter_stats {
+    unsigned long filtered;
+    unsigned long logged;
+};
+
+/*format of the records written in the log file*/
+enum log_mode {
+    LOG_MODE_TEXT, //one self-contained line per event
+    LOG_MODE_DICT, //strings defined once, events refer to them by id (decoded by test/log_decode)
+    LOG_MODE_AGGR  //first occurrence of a (rule, operation, uid, program) key in full, then periodic summaries
+};
+
+/*Dictionary of the strings written in the log: rule paths, program paths and digests.
+The first occurrence of a string emits "D <id> <kind> <string>", the events emit
+"E <rule> <operation> <program> <digest> <tgid> <tid> <euid> <uid>". "R <version>" starts a new
+dictionary, written at load time and whenever LOG_DICT_MAX strings have been defined*/
+struct dict_entry {
+    struct hlist_node hnode;
+    u32 hash;
+    unsigned int id;
+    char kind; //'r' rule, 'p' program, 'h' digest
+    char str[];
+};
+
+struct log_dict {
+    DECLARE_HASHTABLE(index, LOG_DICT_BITS);
+    unsigned int nr_entries; //also the next id
+};
+
+/*Denials counted per (rule, operation, effective uid, program inode). The first denial of a key
+is logged as in text mode, the following ones are only counted and reported by a summary line
+every aggr_interval seconds. When AGGR_MAX keys are reached the table is flushed and emptied.
+The program is hashed once per key, for its first denial: a program rewritten in place keeps the
+digest it had then*/
+struct aggr_entry {
+    struct hlist_node hnode;
+    u32 hash;
+    enum rm_op op;
+    uid_t euid;
+    dev_t exe_dev;
+    unsigned long exe_ino;
+    u32 exe_generation; //i_generation, the inode number may be reused
+    unsigned long pending; //denials not reported yet
+    unsigned long total;
+    char* digest; //points into strs, after the rule path
+    char strs[];
+};
+
+struct log_aggr {
+    DECLARE_HASHTABLE(index, AGGR_BITS);
+    unsigned int nr_entries;
+    struct delayed_work flush_work;
+};
+
+/*Paths of the programs that attempted a denied operation, resolved by the logger and kept per
+executable inode, least recently used first out. A program renamed after being cached keeps its
+old path until it is evicted*/
+struct exe_path {
+    struct hlist_node hnode;
+    struct list_head lru;
+    u64 key; //blk_key of the executable inode
+    u32 generation; //i_generation, the inode number may be reused
+    char path[];
+};
+
+struct exe_path_cache {
+    struct mutex lock; //taken by the logger, held while the returned path is used
+    DECLARE_HASHTABLE(index, EXE_CACHE_BITS);
+    struct list_head lru; //most recently used first
+    unsigned int nr_entries;
+    char* scratch; //page for d_path on a miss
+    unsigned long hits;
+    unsigned long misses;
+};
+
 struct log_info {
     kuid_t effect_uid;
     kuid_t real_uid;
@@ -46,11 +253,17 @@ struct log_info {
     pid_t tgid;
     char* pathname;
     struct dentry* exe_dentry;
-    struct task_struct* task;
-    struct file *fp_executable;
+    struct file *fp_executable; //counted reference taken by the pre-hook, released by the logger
+    enum rm_op op;
     char* file_content_hash;
 };
 
+//paths built by the pre-hooks, one per cpu
+struct hook_buf {
+    char path[PATH_MAX];
+    char target[PATH_MAX]; //canonical symlink target
+};
+
 typedef struct _packed_work{
     struct work_struct work;
     struct log_info *log_info;
@@ -60,14 +273,68 @@ typedef struct referenceMonitor
 {
     enum rm_state state; //possible state (ON, OFF, REC-ON, REC-OFF)
     node *blk_head_node; //blacklist head node 
+    DECLARE_HASHTABLE(blk_index, BLK_HASH_BITS); //blacklist nodes indexed by (dev, ino)
+    struct {
+        DECLARE_HASHTABLE(index, BLK_HASH_BITS);
+    } blk_names[2]; //blacklist nodes indexed by the last component of their current path through name_hnode[name_slot], for the symlink targets
+    unsigned long blk_count; //number of nodes in the blacklist
+    unsigned long nr_dir_rules; //nodes protecting a directory
+    struct work_struct probe_work; //rearms the probes after a rule dropped by fsnotify
+    struct work_struct rename_work; //rehashes the nodes renamed while their free link was still walked
+    struct kmem_cache* node_cache; //slab cache of the blacklist nodes
+    struct path_arena path_arena; //storage of the node paths
+    struct fsnotify_group *notify_group; //owner of the inode marks of the protected objects
+    struct blk_bloom bloom; //prefilter of the index
+    struct exe_path_cache* exe_cache; //program paths written in the log, static in reference_monitor.c
+    struct hook_buf __percpu *hook_buf; //scratch of the pre-hooks, which run with preemption disabled
+    struct sb_rules sb_rules[BLK_MAX_SB]; //superblocks holding at least one rule
+    unsigned long sb_overflow; //rules on superblocks that found sb_rules full, every superblock is checked while non zero
 	struct file *log_file;
+    enum log_mode log_mode;
+    struct mutex log_mutex; //serializes the writers of the log file, protects log_buf and log_dict
+    char* log_buf;
+    struct log_dict log_dict;
+    struct log_aggr log_aggr;
+    struct log_filter __rcu *log_filter; //NULL when every denial is logged
+    struct log_filter_stats __percpu *filter_stats; //static in reference_monitor.c
     struct workqueue_struct *queue_work;
 	char* pw_hash; //hash of password
-	spinlock_t lock; //accessing in concurrently manner in blacklist list_head structure
+	spinlock_t lock; //serializes the writers of the blacklist, the hooks read it under RCU
+    struct mutex blk_mutex; //serializes the reconfiguration system calls, which sleep on the inode marks
      
 }ref_mon;
 
 
+extern ref_mon *rm; //the reference monitor instance, defined in reference_monitor.c
+
+//key of the (dev, ino) index: the same inode number can be reused on different filesystems
+static inline u64 blk_key(dev_t dev, unsigned long i_ino){
+    return ((u64)dev << 32) ^ (u64)i_ino;
+}
+
+//key of the name index
+static inline u32 blk_name_key(const char* name, unsigned int len){
+    return jhash(name, len, 0);
+}
+
+/*every protected inode carries a mark of rm->notify_group, so an inode whose fsnotify mask lacks
+BLK_MARK_MASK is not in the blacklist: one read of the inode, without touching the index
+(other fsnotify watchers of the same events only cause a full lookup)*/
+static inline bool inode_maybe_protected(struct inode* inode){
+    return (READ_ONCE(inode->i_fsnotify_mask) & BLK_MARK_MASK) == BLK_MARK_MASK;
+}
+
+/*false if no rule lives on sb: the hooks return before any other check. The rules never
+match across filesystems since the subtree walks stop at the root of the superblock*/
+static inline bool sb_has_rules(struct super_block* sb){
+    int i;
+
+    if(READ_ONCE(rm->sb_overflow)) return true;
+    for(i = 0; i < BLK_MAX_SB; i++)
+        if(READ_ONCE(rm->sb_rules[i].sb) == sb) return true;
+    return false;
+}
+
 // Utility function to initialize a kretprobe data
 #define declare_kretprobe(NAME, ENTRY_CALLBACK, EXIT_CALLBACK, DATA_SIZE) \
 static struct kretprobe NAME = {                                          \
@@ -89,13 +356,45 @@ do {
 //functions defined in ./utility/utils.c
 void deferred_logger_handler(struct work_struct* data);
 extern void logging_information(ref_mon* rm, struct log_info* log_info);
-char *file_content_fingerprint(struct task_struct *ctx);
+char *file_content_fingerprint(struct file *file);
 extern int calculate_crypto_hash(const char *content, int size_content, unsigned char* hash);
 extern struct inode *get_parent_inode(struct inode *file_inode);
 extern char *get_path_from_dentry(struct dentry *dentry);
 extern char* password_hash(char* pw, int size);
-extern node* lookup_inode_node_blacklist(struct inode* inode,struct list_head* ptr);
+extern node* lookup_inode_node_blacklist(ref_mon* rm, dev_t dev, unsigned long i_ino);
+extern node* lookup_ancestor_node_blacklist(ref_mon* rm, struct dentry* dentry);
+extern node* lookup_symlink_node_blacklist(ref_mon* rm, struct dentry* dir, const char* target);
+extern char* node_fs_path(node* node_ptr, char* buf, int size);
+extern char* node_current_path(node* node_ptr, char* buf, int size);
+extern void remove_node_blacklist(ref_mon* rm, node* node_ptr);
+extern void release_node_blacklist(ref_mon* rm, node* node_ptr);
+extern const struct fsnotify_ops blk_fsnotify_ops;
+extern void blk_rename_work(struct work_struct* work);
+extern void sb_rules_get(ref_mon* rm, struct super_block* sb);
+extern void sb_rules_put(ref_mon* rm, struct super_block* sb);
+extern const char* const rm_op_name[RM_NR_OPS];
+extern bool log_filter_match(ref_mon* rm, node* node_ptr, enum rm_op op);
+extern void log_aggr_init(struct log_aggr* aggr);
+extern bool log_aggr_account(struct log_aggr* aggr, struct log_info* log_info);
+extern void log_aggr_flush(ref_mon* rm, bool clear);
+extern void log_dict_init(struct log_dict* dict);
+extern int log_dict_reset(struct log_dict* dict, char* buf, size_t size);
+extern int format_log_record(ref_mon* rm, struct log_info* log_info, const char* program, char* buf, size_t size);
+extern int exe_path_cache_init(struct exe_path_cache* cache);
+extern void exe_path_cache_destroy(struct exe_path_cache* cache);
+extern const char* exe_path_get(struct exe_path_cache* cache, struct file* file);
+extern void exe_path_put(struct exe_path_cache* cache);
+extern int bloom_init(struct blk_bloom* bloom, unsigned int bits, unsigned int hashes);
+extern void bloom_destroy(struct blk_bloom* bloom);
+extern void bloom_add(struct blk_bloom* bloom, u64 key);
+extern void bloom_del(struct blk_bloom* bloom, u64 key);
+extern bool bloom_may_contain(struct blk_bloom* bloom, u64 key);
+extern void bloom_report(struct blk_bloom* bloom);
+extern void path_arena_init(struct path_arena* arena);
+extern char* path_arena_strdup(struct path_arena* arena, const char* str, unsigned int len);
+extern void path_arena_free(struct path_arena* arena, char* str, unsigned int len);
+extern void path_arena_destroy(struct path_arena* arena);
 extern char *safe_copy_from_user(char* src_buffer, int len);
-extern struct file* my_get_task_exe_file(struct task_struct *ctx);
+extern struct file* get_current_exe_file_rcu(void);
 
 
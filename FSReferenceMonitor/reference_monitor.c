@@ -57,6 +57,122 @@ declare_kretprobe(security_inode_mknod_probe, inode_mknod_pre_hook, the_hook, si
 declare_kretprobe(security_inode_rename_probe, inode_rename_pre_hook, the_hook,sizeof(struct log_info));
 declare_kretprobe(security_inode_setattr_probe, inode_setattr_pre_hook, the_hook,sizeof(struct log_info));
 
+/*A probe is armed only while the monitor is ON (or REC-ON) and some rule can deny its operation.
+The operations checked only against protected directories (the object is created or removed
+inside one) are not intercepted while all the rules protect files*/
+static struct rm_probe {
+    struct kretprobe* krp;
+    bool dir_rules_only;
+} rm_probes[RM_NR_OPS] = {
+    [RM_OP_OPEN] = { &security_file_open_probe, false },
+    [RM_OP_CREATE] = { &security_inode_create_probe, true },
+    [RM_OP_LINK] = { &security_inode_link_probe, false },
+    [RM_OP_UNLINK] = { &security_inode_unlink_probe, false },
+    [RM_OP_SYMLINK] = { &security_inode_symlink_probe, false },
+    [RM_OP_RMDIR] = { &security_inode_rmdir_probe, true },
+    [RM_OP_MKDIR] = { &security_inode_mkdir_probe, true },
+    [RM_OP_MKNOD] = { &security_inode_mknod_probe, true },
+    [RM_OP_RENAME] = { &security_inode_rename_probe, false },
+    [RM_OP_SETATTR] = { &security_inode_setattr_probe, false },
+};
+
+/*bitmask of the rm_op whose kretprobe is enabled. Kept out of rm: the parameters stay readable
+while the module is unloaded, after rm has been freed*/
+static unsigned long armed_ops;
+
+/*enables the probes needed by the current state and rule set and disables the others,
+called with rm->blk_mutex held (enable/disable_kretprobe sleep)*/
+static void update_probes(void){
+    unsigned long rules, dir_rules, armed;
+    bool active;
+    int op, ret;
+
+    spin_lock(&rm->lock);
+    active = rm->state == ON || rm->state == REC_ON;
+    rules = rm->blk_count;
+    dir_rules = rm->nr_dir_rules;
+    spin_unlock(&rm->lock);
+
+    armed = armed_ops;
+    for(op = 0; op < RM_NR_OPS; op++){
+        bool need = active && (rm_probes[op].dir_rules_only ? dir_rules : rules);
+
+        if(need == test_bit(op, &armed)) continue;
+        ret = need ? enable_kretprobe(rm_probes[op].krp) : disable_kretprobe(rm_probes[op].krp);
+        if(ret){
+            printk("%s: unable to %s the %s probe\n", MODNAME, need ? "arm" : "disarm", rm_op_name[op]);
+            continue;
+        }
+        if(need) __set_bit(op, &armed);
+        else __clear_bit(op, &armed);
+    }
+    WRITE_ONCE(armed_ops, armed);
+}
+
+static void probe_work_handler(struct work_struct* work){
+    mutex_lock(&rm->blk_mutex);
+    update_probes();
+    mutex_unlock(&rm->blk_mutex);
+}
+
+//read-only parameter listing the armed probes
+static int armed_probes_get(char* buffer, const struct kernel_param* kp){
+    unsigned long armed = READ_ONCE(armed_ops);
+    int op, len = 0;
+
+    for(op = 0; op < RM_NR_OPS; op++)
+        if(test_bit(op, &armed))
+            len += scnprintf(buffer + len, PAGE_SIZE - len, "%s%s", len ? "," : "", rm_op_name[op]);
+    len += scnprintf(buffer + len, PAGE_SIZE - len, "\n");
+    return len;
+}
+
+static const struct kernel_param_ops armed_probes_ops = {
+    .get = armed_probes_get,
+};
+module_param_cb(armed_probes, &armed_probes_ops, NULL, 0444);
+MODULE_PARM_DESC(armed_probes, "operations currently intercepted by the reference monitor");
+
+/*program paths written in the log, pointed by rm->exe_cache. Static for the same reason as
+armed_ops, the parameter reads the counters without the lock: it can also be read before
+init_module has initialized it*/
+static struct exe_path_cache exe_cache;
+
+//read-only parameter with the effectiveness of the program path cache
+static int exe_path_cache_get(char* buffer, const struct kernel_param* kp){
+    return scnprintf(buffer, PAGE_SIZE, "hits %lu misses %lu entries %u\n", READ_ONCE(exe_cache.hits),
+            READ_ONCE(exe_cache.misses), READ_ONCE(exe_cache.nr_entries));
+}
+
+static const struct kernel_param_ops exe_path_cache_ops = {
+    .get = exe_path_cache_get,
+};
+module_param_cb(exe_path_cache, &exe_path_cache_ops, NULL, 0444);
+MODULE_PARM_DESC(exe_path_cache, "hits and misses of the cache of the program paths written in the log");
+
+/*counters of the log filters, kept out of rm like armed_ops: rm->filter_stats points to
+filter_stats, nr_log_filters follows the filters installed by sys_set_log_filter*/
+static DEFINE_PER_CPU(struct log_filter_stats, filter_stats);
+static unsigned int nr_log_filters;
+
+//read-only parameter with the number of filtered and logged denials
+static int log_filter_get(char* buffer, const struct kernel_param* kp){
+    unsigned long filtered = 0, logged = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu){
+        filtered += READ_ONCE(per_cpu(filter_stats, cpu).filtered);
+        logged += READ_ONCE(per_cpu(filter_stats, cpu).logged);
+    }
+    return scnprintf(buffer, PAGE_SIZE, "filters %u filtered %lu logged %lu\n", READ_ONCE(nr_log_filters), filtered, logged);
+}
+
+static const struct kernel_param_ops log_filter_ops = {
+    .get = log_filter_get,
+};
+module_param_cb(log_filter, &log_filter_ops, NULL, 0444);
+MODULE_PARM_DESC(log_filter, "denials dropped by the log filters and denials handed to the logger");
+
 /*sys_switch_state: cambiamento dello stato del reference monitor*/
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
@@ -137,7 +253,11 @@ asmlinkage int sys_switch_state(enum state, char __user* pw, int len){
         return -EINVAL;
     }
     spin_unlock(&rm->lock);
-    return rm->state;
+
+    mutex_lock(&rm->blk_mutex);
+    update_probes();
+    mutex_unlock(&rm->blk_mutex);
+    return state;
 }
 
 
@@ -152,6 +272,9 @@ asmlinkage int sys_print_blacklist(char __user * pw, int pw_size){
     char* pw_buffer;
     char* hash_digest;
     struct list_head *ptr;
+    unsigned long blk_count, arena_pages, arena_live;
+    char *buf, *path;
+    int i;
 
     if(!pw) return -EINVAL;
 
@@ -187,43 +310,46 @@ asmlinkage int sys_print_blacklist(char __user * pw, int pw_size){
         printk("%s: the blacklist is empty\n", MODNAME);
         return 0;
     }
-    // prints all paths of blacklist
+    // prints all paths of blacklist, as they are now
+    buf = (char*)__get_free_page(GFP_ATOMIC);
     printk("%s: blacklist:\n", MODNAME);
     list_for_each(ptr,&rm->blk_head_node->elem) {
         node_ptr =container_of(ptr, node, elem); 
-        printk("%s: path %s\n",MODNAME, node_ptr->path);               
-        //printk("%s: (address element %p, inode->i_ino %lu, path %s, inode %p, dentry %p, prev = %p, next = %p)\n",MODNAME, ptr, node_ptr->inode_cod, node_ptr->path, node_ptr->inode_blk, node_ptr->dentry_blk, ptr->prev, ptr->next);               
+        path = buf ? node_current_path(node_ptr, buf, PAGE_SIZE) : NULL;
+        printk("%s: path %s\n",MODNAME, path ? path : node_ptr->path);               
+        //printk("%s: (address element %p, inode->i_ino %lu, path %s, prev = %p, next = %p)\n",MODNAME, ptr, node_ptr->inode_cod, node_ptr->path, ptr->prev, ptr->next);               
     }
+    free_page((unsigned long)buf);
+    blk_count = rm->blk_count;
+    for(i = 0; i < BLK_MAX_SB; i++)
+        if(rm->sb_rules[i].sb)
+            printk("%s: %lu rules on %s\n", MODNAME, rm->sb_rules[i].nr_rules, rm->sb_rules[i].sb->s_id);
+    if(rm->sb_overflow)
+        printk("%s: %lu rules on untracked filesystems, every filesystem is checked\n", MODNAME, rm->sb_overflow);
     spin_unlock(&rm->lock);
+
+    //memory footprint of the blacklist (the index buckets are embedded in rm)
+    spin_lock_bh(&rm->path_arena.lock);
+    arena_pages = rm->path_arena.nr_pages;
+    arena_live = rm->path_arena.live_bytes;
+    spin_unlock_bh(&rm->path_arena.lock);
+    printk("%s: %lu paths, %lu bytes of nodes (%zu each), %lu bytes of path arena (%lu in use)\n", MODNAME,
+            blk_count, blk_count * kmem_cache_size(rm->node_cache), kmem_cache_size(rm->node_cache), arena_pages * PAGE_SIZE, arena_live);
+    bloom_report(&rm->bloom);
     return 0;
 
 }
 
-/*sys_add_path_blacklist: adds a file/directory path to the blacklist*/
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
-__SYSCALL_DEFINEx(4,_add_path_blacklist, char __user*, buffer_path, int, len ,char __user*, pw,int, pw_size){
-#else
-asmlinkage int sys_add_path_blacklist(char __user* buffer_path, int len, char __user* pw,int pw_size){
-#endif
-  
+/*checks EUID, state and password shared by the reconfiguration system calls*/
+static int check_reconfiguration_permission(char __user* pw, int pw_size){
     const struct cred *cred = current_cred();
-    struct inode *inode ;
-    node * node_ptr ;
-    int error;
-    struct list_head *ptr ;
-    struct path struct_path;
-    char* hash_digest ;
-    node* node_ptr_aux ;
-    char* pathname ;
-    int len_pathname;
-    char* pw_buffer ;
-    
-    //check EUID
+    char* hash_digest;
+    char* pw_buffer;
+
     if (!uid_eq(cred->euid, GLOBAL_ROOT_UID)){ 
         printk("%s: Only EUID 0 (root) can perform the insert/delete path activity\n", MODNAME);
         return -EPERM; 
     }
-    //check state of the reference monitor
     spin_lock(&rm->lock);
     if(rm->state == OFF || rm->state == ON){
         spin_unlock(&rm->lock);
@@ -232,8 +358,7 @@ asmlinkage int sys_add_path_blacklist(char __user* buffer_path, int len, char __
     }
     spin_unlock(&rm->lock);
 
-    //check input syscall
-    if(!pw || !buffer_path) return -EINVAL;
+    if(!pw) return -EINVAL;
 
     pw_buffer = safe_copy_from_user(pw, pw_size);
     if(!pw_buffer){
@@ -242,76 +367,179 @@ asmlinkage int sys_add_path_blacklist(char __user* buffer_path, int len, char __
     }
 
     hash_digest = password_hash(pw_buffer, strlen(pw_buffer));
+    kfree(pw_buffer);
     if(!hash_digest){
-         kfree(pw_buffer);
         printk("%s:password computation hash failed\n", MODNAME);
         return -ENOMEM;
     }
-
+    
     spin_lock(&rm->lock);
-    if( strcmp(rm->pw_hash, hash_digest) != 0 ){   //compare password hash
+    if( strcmp(rm->pw_hash, hash_digest) != 0 ){   
         spin_unlock(&rm->lock);
-        printk("%s: mismatching of the password\n", MODNAME);
         kfree(hash_digest);
-        kfree(pw_buffer);
+        printk("%s: mismatching of the password\n", MODNAME);
         return -EINVAL; 
     }
     spin_unlock(&rm->lock);
+    kfree(hash_digest);
+    return 0;
+}
 
-    if(hash_digest) kfree(hash_digest);
+/*sys_add_path_blacklist: adds a file/directory path to the blacklist*/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
+__SYSCALL_DEFINEx(4,_add_path_blacklist, char __user*, buffer_path, int, len ,char __user*, pw,int, pw_size){
+#else
+asmlinkage int sys_add_path_blacklist(char __user* buffer_path, int len, char __user* pw,int pw_size){
+#endif
+  
+    struct inode *inode ;
+    node * node_ptr ;
+    int error;
+    struct path struct_path;
+    char* pathname ;
+    char *canonical, *fs_path, *root, *below, *name;
+    unsigned int len_pathname, root_len, mnt_off;
+    u32 name_key;
+    
+    //check input syscall
+    if(!buffer_path) return -EINVAL;
+
+    error = check_reconfiguration_permission(pw, pw_size);
+    if(error) return error;
     
     pathname = safe_copy_from_user(buffer_path, len);
     if(!pathname){
         printk("%s: error in safe_copy_from_user\n", MODNAME);
         return -ENOMEM;
     }
-    len_pathname = strlen(pathname);
-  
 
     error=kern_path(pathname,LOOKUP_FOLLOW, &struct_path); //checking the path validity
+    kfree(pathname);
     if(error){
         printk("%s:kern_path failed, the file or directory doesn't exists \n", MODNAME);
         return -ENOMEM;
     }
 
-    //Add the new node to the blacklist
-    spin_lock(&rm->lock);
-    node_ptr = kmalloc(sizeof(node), GFP_ATOMIC);
-    if(!node_ptr) return -ENOMEM;
+    node_ptr = kmem_cache_alloc(rm->node_cache, GFP_KERNEL);
+    pathname = (char*)__get_free_pages(GFP_KERNEL, 1);
+    if(!node_ptr || !pathname){
+        if(node_ptr) kmem_cache_free(rm->node_cache, node_ptr);
+        free_pages((unsigned long)pathname, 1);
+        path_put(&struct_path);
+        return -ENOMEM;
+    }
 
-    node_ptr->path = kstrndup(pathname,len_pathname,GFP_KERNEL);
+    /*the rule keeps the absolute path and splits it into the mount prefix and the position of the
+    object under the mount root, whose path in the filesystem is kept as well: the hooks rebuild the
+    current path from the dentry tree, so that the renames are followed (see node_current_path)*/
+    canonical = d_path(&struct_path, pathname, PAGE_SIZE);
+    fs_path = IS_ERR(canonical) ? canonical : dentry_path_raw(struct_path.dentry, pathname + PAGE_SIZE, PAGE_SIZE);
+    root = IS_ERR(fs_path) ? fs_path : dentry_path_raw(struct_path.mnt->mnt_root, pathname, canonical - pathname);
+    if(IS_ERR(root)){
+        free_pages((unsigned long)pathname, 1);
+        kmem_cache_free(rm->node_cache, node_ptr);
+        path_put(&struct_path);
+        return PTR_ERR(root);
+    }
+    len_pathname = strlen(canonical);
+    root_len = strcmp(root, "/") ? strlen(root) : 0;
+    below = fs_path + root_len;
+    if(!strcmp(below, "/") && len_pathname > 1)
+        below++;
+    if(len_pathname < strlen(below) || strcmp(canonical + len_pathname - strlen(below), below) || len_pathname + 1 + root_len >= PAGE_SIZE){
+        //not reachable from the root of the caller
+        free_pages((unsigned long)pathname, 1);
+        kmem_cache_free(rm->node_cache, node_ptr);
+        path_put(&struct_path);
+        return -EINVAL;
+    }
+    mnt_off = len_pathname - strlen(below);
+    name = strrchr(canonical, '/') + 1;
+    name_key = blk_name_key(name, strlen(name));
+    //interned as "<path>\0<mount root>", built where the path under the filesystem root was
+    memmove(pathname + PAGE_SIZE, canonical, len_pathname + 1);
+    memcpy(pathname + PAGE_SIZE + len_pathname + 1, root, root_len);
+    node_ptr->path = path_arena_strdup(&rm->path_arena, pathname + PAGE_SIZE, len_pathname + 1 + root_len);
+    free_pages((unsigned long)pathname, 1);
     if(!node_ptr->path){
-        printk("%s: kstrdup failed\n", MODNAME);
+        printk("%s: path arena allocation failed\n", MODNAME);
+        kmem_cache_free(rm->node_cache, node_ptr);
+        path_put(&struct_path);
         return -ENOMEM;
     }
-    
-    if(!struct_path.dentry) return -EFAULT;
-    
-    if(pathname) kfree(pathname);
+    node_ptr->path_len = len_pathname;
+    node_ptr->mnt_off = mnt_off;
+    node_ptr->root_len = root_len;
+    node_ptr->name_slot = 0;
+    node_ptr->name_stale = false;
+    node_ptr->name_retired = get_state_synchronize_rcu(); //name_hnode[1] has never been hashed, a rename just after the insertion waits in rename_work
     
     inode =  struct_path.dentry->d_inode; //retrieve inode from kern_path
-    if(list_empty(&rm->blk_head_node->elem)) goto insert; //if blacklist is empty, skip the check if inode is already present!
-
-    list_for_each(ptr,&rm->blk_head_node->elem) { /*check if inode is already present*/ 
-        node_ptr_aux =container_of(ptr, node, elem); 
-        if(!node_ptr_aux) return -EFAULT;
-        if(node_ptr_aux->inode_cod == inode->i_ino){
-            printk("%s: the path %s is already present!\n",MODNAME, node_ptr->path);
-            kfree(node_ptr->path);
-            kfree(node_ptr);
-            spin_unlock(&rm->lock);
-            return -EINVAL;
-        }
-    }
-insert:
+    node_ptr->dev = inode->i_sb->s_dev;
     node_ptr->inode_cod = inode->i_ino;
     node_ptr->inode_blk = inode;
-    node_ptr->dentry_blk = struct_path.dentry;
-    list_add_tail(&node_ptr->elem,&rm->blk_head_node->elem);  // Adding the new node to the blacklist
+    fsnotify_init_mark(&node_ptr->fsn_mark, rm->notify_group);
+    node_ptr->fsn_mark.mask = BLK_MARK_MASK;
+
+    //Add the new node to the blacklist
+    mutex_lock(&rm->blk_mutex);
+    spin_lock(&rm->lock);
+    if(lookup_inode_node_blacklist(rm, node_ptr->dev, node_ptr->inode_cod)){ /*check if inode is already present*/ 
+        spin_unlock(&rm->lock);
+        mutex_unlock(&rm->blk_mutex);
+        printk("%s: the path %s is already present!\n",MODNAME, node_ptr->path);
+        fsnotify_put_mark(&node_ptr->fsn_mark); //never attached, the node is released by blk_free_mark
+        path_put(&struct_path);
+        return -EINVAL;
+    }
+    sb_rules_get(rm, inode->i_sb); //before the node becomes visible
+    bloom_add(&rm->bloom, blk_key(node_ptr->dev, node_ptr->inode_cod));
+    if(S_ISDIR(inode->i_mode))
+        rm->nr_dir_rules++;
+    hash_add_rcu(rm->blk_index, &node_ptr->hnode, blk_key(node_ptr->dev, node_ptr->inode_cod));
+    hash_add_rcu(rm->blk_names[0].index, &node_ptr->name_hnode[0], name_key);
+    list_add_tail_rcu(&node_ptr->elem,&rm->blk_head_node->elem);  // Adding the new node to the blacklist
+    rm->blk_count++;
     spin_unlock(&rm->lock); 
-    return 0;
+
+    /*the mark keeps the inode (not the dentry) in memory and drops the rule when the inode is deleted.
+    An inode unlinked before the mark was attached is not notified, hence the i_nlink check*/
+    error = fsnotify_add_inode_mark(&node_ptr->fsn_mark, inode, 0);
+    if(error || !inode->i_nlink){
+        spin_lock(&rm->lock);
+        if(!hlist_unhashed(&node_ptr->hnode))
+            remove_node_blacklist(rm, node_ptr);
+        spin_unlock(&rm->lock);
+        if(!error){
+            fsnotify_destroy_mark(&node_ptr->fsn_mark, rm->notify_group);
+            error = -ENOENT;
+        }
+        printk("%s: unable to track the path %s\n", MODNAME, node_ptr->path);
+    }
+    fsnotify_put_mark(&node_ptr->fsn_mark); //from now on the node belongs to the inode mark
+    update_probes();
+    mutex_unlock(&rm->blk_mutex);
+    path_put(&struct_path);
+    return error;
 }
 
+/*resolves a path to the (dev, ino) key used by the blacklist index*/
+static int resolve_path_key(const char* pathname, dev_t* dev, unsigned long* i_ino){
+    struct path struct_path;
+    struct inode* inode;
+    int error;
+
+    error=kern_path(pathname,LOOKUP_FOLLOW, &struct_path);
+    if(error){
+        printk("%s:kern_path failed, the file or directory %s doesn't exists \n", MODNAME, pathname);
+        return -ENOENT;
+    }
+    inode = struct_path.dentry->d_inode;
+    *dev = inode->i_sb->s_dev;
+    *i_ino = inode->i_ino;
+    path_put(&struct_path);
+    return 0;
+}
 
 /*sys_remove_path_blacklist: delete path in the blacklist*/
 
@@ -321,82 +549,196 @@ __SYSCALL_DEFINEx(4,_remove_path_blacklist, char __user*, buffer_path, int, len
 asmlinkage int sys_remove_path_blacklist(char __user* buffer_path, int len, char __user* pw,int pw_size){
 #endif
   
-    const struct cred *cred = current_cred();
     node * node_ptr;
     int error;
-    struct list_head *ptr;
-    struct path struct_path;
-    char* hash_digest;
     char* pathname;
-    char* pw_buffer;
+    dev_t dev;
+    unsigned long i_ino;
 
-    if (!uid_eq(cred->euid, GLOBAL_ROOT_UID)){ 
-        printk("%s: Only EUID 0 (root) can perform the insert/delete path activity\n", MODNAME);
-        return -EPERM; 
+    error = check_reconfiguration_permission(pw, pw_size);
+    if(error) return error;
+
+    pathname = safe_copy_from_user(buffer_path, len);
+    if(!pathname){
+        printk("%s: error in safe_copy_from_user\n", MODNAME);
+        return -ENOMEM;
     }
+    error = resolve_path_key(pathname, &dev, &i_ino);
+    kfree(pathname);
+    if(error) return error;
+
+    /*delete path phase*/
+
+    mutex_lock(&rm->blk_mutex);
     spin_lock(&rm->lock);
-    if(rm->state == OFF || rm->state == ON){
+    node_ptr = lookup_inode_node_blacklist(rm, dev, i_ino);
+    if(!node_ptr){
         spin_unlock(&rm->lock);
-        printk("%s: Switch to REC-ON or REC-OFF state in order to perform the insert/delete path activity\n", MODNAME);
-        return -EINVAL;    
+        mutex_unlock(&rm->blk_mutex);
+        printk("%s: path to remove not found \n", MODNAME);
+        return -EINVAL;
     }
+    remove_node_blacklist(rm, node_ptr);
+    fsnotify_get_mark(&node_ptr->fsn_mark); //the inode may be deleted meanwhile, the node must survive until release
     spin_unlock(&rm->lock);
+    release_node_blacklist(rm, node_ptr);
+    update_probes();
+    mutex_unlock(&rm->blk_mutex);
+    printk("%s: path removed correctly \n", MODNAME);
+    return 0;
+}
 
-    pw_buffer = safe_copy_from_user(pw, pw_size);
-    if(!pw_buffer){
-        printk("%s: error in safe_copy_from_user\n", MODNAME);
-        return -ENOMEM;
+/*sys_remove_paths_blacklist: delete a set of paths in the blacklist, returns the number of removed paths.
+paths is an array of count user pointers to NUL terminated strings*/
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
+__SYSCALL_DEFINEx(4,_remove_paths_blacklist, char __user* __user*, paths, int, count ,char __user*, pw,int, pw_size){
+#else
+asmlinkage int sys_remove_paths_blacklist(char __user* __user* paths, int count, char __user* pw,int pw_size){
+#endif
+    char __user** user_paths;
+    char* pathname;
+    dev_t* devs;
+    unsigned long* i_inos;
+    node ** removed_nodes;
+    int error, i, resolved = 0, removed = 0;
+
+    if(count <= 0 || count > MAX_BULK_PATHS || !paths) return -EINVAL;
+
+    error = check_reconfiguration_permission(pw, pw_size);
+    if(error) return error;
+
+    user_paths = kmalloc_array(count, sizeof(char __user*), GFP_KERNEL);
+    devs = kmalloc_array(count, sizeof(dev_t), GFP_KERNEL);
+    i_inos = kmalloc_array(count, sizeof(unsigned long), GFP_KERNEL);
+    removed_nodes = kmalloc_array(count, sizeof(node*), GFP_KERNEL);
+    if(!user_paths || !devs || !i_inos || !removed_nodes){
+        error = -ENOMEM;
+        goto out;
+    }
+    if(copy_from_user(user_paths, paths, count * sizeof(char __user*))){
+        error = -EFAULT;
+        goto out;
     }
 
-    hash_digest = password_hash(pw_buffer, strlen(pw_buffer));
-    if(!hash_digest){
-        printk("%s:password computation hash failed\n", MODNAME);
-        return -ENOMEM;
+    //the path walks are done before taking the lock, unresolvable paths are skipped
+    for(i = 0; i < count; i++){
+        pathname = strndup_user(user_paths[i], PATH_MAX);
+        if(IS_ERR(pathname)) continue;
+        if(resolve_path_key(pathname, &devs[resolved], &i_inos[resolved]) == 0)
+            resolved++;
+        kfree(pathname);
     }
-    
+
+    mutex_lock(&rm->blk_mutex);
     spin_lock(&rm->lock);
-    if( strcmp(rm->pw_hash, hash_digest) != 0 ){   
-        spin_unlock(&rm->lock);
-        printk("%s: mismatching of the password\n", MODNAME);
-        return -EINVAL; 
+    for(i = 0; i < resolved; i++){
+        removed_nodes[removed] = lookup_inode_node_blacklist(rm, devs[i], i_inos[i]);
+        if(!removed_nodes[removed]) continue;
+        remove_node_blacklist(rm, removed_nodes[removed]);
+        fsnotify_get_mark(&removed_nodes[removed]->fsn_mark);
+        removed++;
     }
     spin_unlock(&rm->lock);
 
-    pathname = safe_copy_from_user(buffer_path, len);
-    if(!pathname){
-        printk("%s: error in safe_copy_from_user\n", MODNAME);
-        return -ENOMEM;
-    }
+    //the marks are detached outside the spinlock, the nodes are freed by blk_free_mark after a grace period
+    for(i = 0; i < removed; i++)
+        release_node_blacklist(rm, removed_nodes[i]);
+    update_probes();
+    mutex_unlock(&rm->blk_mutex);
+    printk("%s: %d paths removed \n", MODNAME, removed);
+    error = removed;
+out:
+    kfree(user_paths);
+    kfree(devs);
+    kfree(i_inos);
+    kfree(removed_nodes);
+    return error;
+}
 
-    error=kern_path(pathname,LOOKUP_FOLLOW, &struct_path);
-    if(error){
-        printk("%s:kern_path failed, the file or directory doesn't exists \n", MODNAME);
-        return -ENOMEM;
-    }
+/*sys_set_log_filter: replaces the filters of the log with the count filters of specs (count 0 removes them).
+The denials matching a filter are still denied but not logged*/
 
-    /*delete path phase*/
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
+__SYSCALL_DEFINEx(4,_set_log_filter, struct log_filter_spec __user*, specs, int, count ,char __user*, pw,int, pw_size){
+#else
+asmlinkage int sys_set_log_filter(struct log_filter_spec __user* specs, int count, char __user* pw,int pw_size){
+#endif
+    struct log_filter_spec* user_specs = NULL;
+    struct log_filter* filter = NULL;
+    struct log_filter* old_filter;
+    struct log_filter_rule* rule;
+    char* pathname;
+    int error, i;
 
-    spin_lock(&rm->lock);
+    if(count < 0 || count > MAX_LOG_FILTERS || (count && !specs)) return -EINVAL;
 
-    if(list_empty(&rm->blk_head_node->elem)){ //check if the blacklist is empty 
-            spin_unlock(&rm->lock);
-            printk("%s: the blacklist is empty\n", MODNAME);
-            return -EFAULT;
-    }
-        list_for_each(ptr,&rm->blk_head_node->elem) {  
-            node_ptr =container_of(ptr, node, elem);
-            if(strcmp(node_ptr->path , pathname) == 0){ 
-                list_del(ptr);
-                spin_unlock(&rm->lock);
-                printk("%s: path removed correctly \n", MODNAME);
-                return 0;
+    error = check_reconfiguration_permission(pw, pw_size);
+    if(error) return error;
+
+    if(count){
+        user_specs = kmalloc_array(count, sizeof(struct log_filter_spec), GFP_KERNEL);
+        filter = kzalloc(struct_size(filter, rules, count), GFP_KERNEL);
+        if(!user_specs || !filter){
+            error = -ENOMEM;
+            goto out;
+        }
+        if(copy_from_user(user_specs, specs, count * sizeof(struct log_filter_spec))){
+            error = -EFAULT;
+            goto out;
+        }
+        //the paths are resolved here, the hooks compare (dev, ino) pairs
+        for(i = 0; i < count; i++){
+            rule = &filter->rules[i];
+            rule->ops = user_specs[i].ops ? user_specs[i].ops & (BIT(RM_NR_OPS) - 1) : BIT(RM_NR_OPS) - 1;
+            if(user_specs[i].uid >= 0){
+                rule->fields |= FILTER_UID;
+                rule->uid = user_specs[i].uid;
             }
+            if(user_specs[i].euid >= 0){
+                rule->fields |= FILTER_EUID;
+                rule->euid = user_specs[i].euid;
+            }
+            if(user_specs[i].exe){
+                pathname = strndup_user(user_specs[i].exe, PATH_MAX);
+                if(IS_ERR(pathname)){
+                    error = PTR_ERR(pathname);
+                    goto out;
+                }
+                error = resolve_path_key(pathname, &rule->exe_dev, &rule->exe_ino);
+                kfree(pathname);
+                if(error) goto out;
+                rule->fields |= FILTER_EXE;
+            }
+            if(user_specs[i].rule){
+                pathname = strndup_user(user_specs[i].rule, PATH_MAX);
+                if(IS_ERR(pathname)){
+                    error = PTR_ERR(pathname);
+                    goto out;
+                }
+                error = resolve_path_key(pathname, &rule->rule_dev, &rule->rule_ino);
+                kfree(pathname);
+                if(error) goto out;
+                rule->fields |= FILTER_RULE;
+            }
+            filter->ops |= rule->ops;
         }
+        filter->nr_rules = count;
+    }
 
-        spin_unlock(&rm->lock);
-        printk("%s: path to remove not found \n", MODNAME);
-        return -EINVAL;
-
+    mutex_lock(&rm->blk_mutex);
+    old_filter = rcu_replace_pointer(rm->log_filter, filter, lockdep_is_held(&rm->blk_mutex));
+    WRITE_ONCE(nr_log_filters, count);
+    mutex_unlock(&rm->blk_mutex);
+    if(old_filter)
+        kfree_rcu(old_filter, rcu);
+    filter = NULL;
+    printk("%s: %d log filters installed\n", MODNAME, count);
+    error = 0;
+out:
+    kfree(user_specs);
+    kfree(filter);
+    return error;
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
@@ -404,6 +746,8 @@ unsigned long sys_switch_state = (unsigned long) __x64_sys_switch_state;
 unsigned long sys_add_path_blacklist = (unsigned long) __x64_sys_add_path_blacklist; 
 unsigned long sys_remove_path_blacklist = (unsigned long) __x64_sys_remove_path_blacklist; 
 unsigned long sys_print_blacklist = (unsigned long) __x64_sys_print_blacklist;   
+unsigned long sys_remove_paths_blacklist = (unsigned long) __x64_sys_remove_paths_blacklist; 
+unsigned long sys_set_log_filter = (unsigned long) __x64_sys_set_log_filter; 
 #endif
 
 unsigned long systemcall_table=0x0;
@@ -412,6 +756,18 @@ char *password=NULL;
 module_param(password, charp, 0444); // 0444 imposta i permessi di sola lettura (ro)
 int free_entries[15];
 module_param_array(free_entries,int,NULL,0660);
+static unsigned int log_mode = LOG_MODE_TEXT; //format of the log records
+module_param(log_mode, uint, 0444);
+MODULE_PARM_DESC(log_mode, "0: one text line per event, 1: dictionary encoded records (decoded by test/log_decode), 2: aggregated summaries");
+static unsigned int aggr_interval = AGGR_DEFAULT_INTERVAL; //seconds between two summaries in aggregation mode
+module_param(aggr_interval, uint, 0444);
+MODULE_PARM_DESC(aggr_interval, "seconds between two summary records when log_mode is 2");
+static unsigned int bloom_bits = BLOOM_DEFAULT_BITS; //size of the prefilter: 2^bloom_bits one byte counters
+module_param(bloom_bits, uint, 0444);
+MODULE_PARM_DESC(bloom_bits, "log2 of the number of counters of the blacklist prefilter (8-24)");
+static unsigned int bloom_hashes = BLOOM_DEFAULT_HASHES; //hash functions of the prefilter
+module_param(bloom_hashes, uint, 0444);
+MODULE_PARM_DESC(bloom_hashes, "hash functions of the blacklist prefilter (1-8)");
 
 static inline void write_cr0_forced(unsigned long val){
     unsigned long __force_order;
@@ -432,6 +788,35 @@ static inline void unprotect_memory(void){
 
 
 
+/* Fills the kretprobe data of a denied operation and leaves the RCU read-side section
+opened by the pre-hook. The path is copied since the node can be removed (and freed)
+before the exit handler runs.*/
+static int deny_operation(struct kretprobe_instance *ri, node* node_ptr, enum rm_op op){
+    struct log_info* log_info;
+    struct file* exe_file;
+    char* pathname;
+
+    log_info = (struct log_info*) ri->data;
+    if(log_filter_match(rm, node_ptr, op)){
+        //denied without logging: nothing is handed to the logger
+        log_info->pathname = NULL;
+        log_info->fp_executable = NULL;
+        rcu_read_unlock();
+        return 0;
+    }
+    exe_file = get_current_exe_file_rcu();
+    if(!exe_file){
+        rcu_read_unlock();
+        return 1;
+    }
+    pathname = node_current_path(node_ptr, this_cpu_ptr(rm->hook_buf)->path, PATH_MAX); //renames included
+    log_info->pathname = kstrdup(pathname ? pathname : node_ptr->path, GFP_ATOMIC);
+    log_info->fp_executable = exe_file; //the content is hashed by the logger, even after the process exits
+    log_info->op = op;
+    rcu_read_unlock();
+    return 0;
+}
+
 /**
  * int (*inode_permission)(struct inode *inode, int mask);
  * Check permission before accessing an inode (Write access must be blocked here ). 
@@ -445,33 +830,27 @@ static inline void unprotect_memory(void){
 
  int security_file_open_pre_hook(struct kretprobe_instance  *ri, struct pt_regs *regs){
     struct file* file;
-    struct log_info* log_info;
     node* node_ptr_h;
-    struct list_head* ptr_h;
-    struct file* exe_file;
+    struct inode* inode;
     fmode_t mode;
     
     
-    spin_lock(&rm->lock);
-    if(list_empty(&rm->blk_head_node->elem) || ((rm->state == REC_OFF || rm->state == OFF ))) goto leave;
     file = (struct file*)regs->di;
     mode = file->f_mode;
-   list_for_each(ptr_h,&rm->blk_head_node->elem) {
-        node_ptr_h = (node*)list_entry(ptr_h, node, elem);
-        if(!node_ptr_h) goto leave;
-        if((node_ptr_h->inode_cod  == file->f_inode->i_ino)  &&  ((mode & FMODE_WRITE) || (mode & FMODE_PWRITE))){  
-                spin_unlock(&rm->lock);
+    if(!((mode & FMODE_WRITE) || (mode & FMODE_PWRITE))) return 1;
+    inode = file->f_inode;
+    if(!inode_maybe_protected(inode)) return 1; //most of the opens stop here
+    if(!sb_has_rules(inode->i_sb)) return 1;
+
+    rcu_read_lock();
+    if(list_empty(&rm->blk_head_node->elem) || ((READ_ONCE(rm->state) == REC_OFF || READ_ONCE(rm->state) == OFF ))) goto leave;
+    node_ptr_h = lookup_inode_node_blacklist(rm, inode->i_sb->s_dev, inode->i_ino);
+    if(node_ptr_h){  
                 printk("%s: write file denied\n", MODNAME);
-                exe_file = my_get_task_exe_file(current);
-                if(!exe_file) return 1;
-                log_info = (struct log_info*) ri->data;
-                log_info->pathname = node_ptr_h->path;
-                log_info->task = current;
-                return 0;
-        }
+                return deny_operation(ri, node_ptr_h, RM_OP_OPEN);
     }
 leave:
-    spin_unlock(&rm->lock);
+    rcu_read_unlock();
     return 1; 
  }
 
@@ -490,34 +869,23 @@ Returns 0 if permission is granted.
 
 int inode_create_pre_hook(struct kretprobe_instance  *ri, struct pt_regs *regs){
     struct inode* parent_inode;
-    struct dentry* parent_dentry;
+    struct dentry* dentry;
     node* node_ptr_h;
-    struct list_head* ptr_h;
-    struct file* exe_file;
-    struct log_info* log_info;
 
-    spin_lock(&rm->lock);
-    if(list_empty(&rm->blk_head_node->elem) || ((rm->state == REC_OFF || rm->state == OFF ))) goto leave;
     parent_inode = (struct inode*)regs->di;
-    parent_dentry = d_find_alias(parent_inode);
-   list_for_each(ptr_h,&rm->blk_head_node->elem) {
-            node_ptr_h = (node*)list_entry(ptr_h, node, elem);
-            if(!node_ptr_h) goto leave;
-            if((parent_inode->i_ino == node_ptr_h->inode_cod)|| (is_subdir(parent_dentry,node_ptr_h->dentry_blk))){
-                        spin_unlock(&rm->lock);
-                        printk("%s: vfs_create denied\n ", MODNAME);
-                        log_info = (struct log_info*) ri->data;
-                        exe_file = my_get_task_exe_file(current);
-                        if(!exe_file) return 1;
-                        log_info->pathname = node_ptr_h->path;
-                        log_info->task = current;
-    
-                        return 0;
-            }
-    }
+    if(!sb_has_rules(parent_inode->i_sb)) return 1;
+
+    rcu_read_lock();
+    if(list_empty(&rm->blk_head_node->elem) || ((READ_ONCE(rm->state) == REC_OFF || READ_ONCE(rm->state) == OFF ))) goto leave;
+    dentry = (struct dentry*)regs->si; //negative, its parent is parent_inode
+    node_ptr_h = lookup_ancestor_node_blacklist(rm, dentry); //protected directories containing the object
+    if(node_ptr_h) goto deny;
 leave:
-    spin_unlock(&rm->lock);
+    rcu_read_unlock();
     return 1; 
+deny:
+    printk("%s: vfs_create denied\n ", MODNAME);
+    return deny_operation(ri, node_ptr_h, RM_OP_CREATE);
 }
 
 /*int security_inode_link(struct dentry *old_dentry, struct inode *dir, struct dentry *new_dentry);
@@ -533,41 +901,28 @@ leave:
 
 int inode_link_pre_hook(struct kretprobe_instance  *ri, struct pt_regs *regs){
     struct dentry* old_dentry; //dentry structure for an existing link to the file
-    struct inode* parent_inode; //parent inode dir of the new link
-    //struct dentry* new_dentry = regs->dx; // dentry structure for the new link
-    //struct inode* inode = old_dentry->d_inode;
-    struct dentry* parent_dentry; 
+    struct dentry* new_dentry; // dentry structure for the new link
+    struct inode* inode;
     node* node_ptr_h;
-    struct list_head* ptr_h;
-    struct log_info* log_info;
-    struct file* exe_file;
 
-
-    spin_lock(&rm->lock);
-    if(list_empty(&rm->blk_head_node->elem) || ((rm->state == REC_OFF || rm->state == OFF ))) goto leave;
-
-    parent_inode = (struct inode* )regs->si;
     old_dentry = (struct dentry* )regs->di;
+    inode = old_dentry->d_inode;
+    if(!sb_has_rules(inode->i_sb)) return 1; //hard links do not cross filesystems
 
-    parent_dentry = d_find_alias(parent_inode);
-   list_for_each(ptr_h,&rm->blk_head_node->elem) {
-            node_ptr_h = (node*)list_entry(ptr_h, node, elem);
-            if(!node_ptr_h) goto leave;
-            if(node_ptr_h->inode_cod == old_dentry->d_inode->i_ino || (is_subdir(parent_dentry,node_ptr_h->dentry_blk))){
-                        spin_unlock(&rm->lock);
-                        printk("%s: vfs_link denied\n ", MODNAME);
-                        log_info = (struct log_info*) ri->data;
-                        exe_file = my_get_task_exe_file(current);
-                        if(!exe_file) return 1;
-                        log_info->pathname = node_ptr_h->path;
-                        log_info->task = current;
-    
-                        return 0;
-            }
-        }
+    rcu_read_lock();
+    if(list_empty(&rm->blk_head_node->elem) || ((READ_ONCE(rm->state) == REC_OFF || READ_ONCE(rm->state) == OFF ))) goto leave;
+
+    node_ptr_h = lookup_inode_node_blacklist(rm, inode->i_sb->s_dev, inode->i_ino);
+    if(node_ptr_h) goto deny;
+    new_dentry = (struct dentry* )regs->dx;
+    node_ptr_h = lookup_ancestor_node_blacklist(rm, new_dentry); //protected directories containing the new link
+    if(node_ptr_h) goto deny;
 leave:
-    spin_unlock(&rm->lock);
+    rcu_read_unlock();
     return 1;
+deny:
+    printk("%s: vfs_link denied\n ", MODNAME);
+    return deny_operation(ri, node_ptr_h, RM_OP_LINK);
 }
 /*int security_inode_unlink(struct inode *dir, struct dentry *dentry) 
  * called in vfs_unlink - unlink a filesystem object
@@ -581,37 +936,24 @@ leave:
  * */
 int inode_unlink_pre_hook(struct kretprobe_instance  *ri, struct pt_regs *regs){
         struct inode* parent_inode; //parent inode dir 
-        struct log_info* log_info;
         struct dentry* dentry; //dentry for file to be unlinked
         node* node_ptr_h;
-        struct list_head* ptr_h;
-        struct file* exe_file;
-        struct dentry* parent_dentry;
 
-        spin_lock(&rm->lock);
-        if(list_empty(&rm->blk_head_node->elem) || ((rm->state == REC_OFF || rm->state == OFF ))) goto leave;
         parent_inode = (struct inode* )regs->di;
+        if(!sb_has_rules(parent_inode->i_sb)) return 1;
+
+        rcu_read_lock();
+        if(list_empty(&rm->blk_head_node->elem) || ((READ_ONCE(rm->state) == REC_OFF || READ_ONCE(rm->state) == OFF ))) goto leave;
         dentry = (struct dentry*) regs->si;
-        parent_dentry = d_find_alias(parent_inode); //dentry structure for an existing link to the file
-       list_for_each(ptr_h,&rm->blk_head_node->elem) {
-            node_ptr_h = (node*)list_entry(ptr_h, node, elem);
-            
-            if((dentry->d_inode->i_ino == node_ptr_h->inode_cod) || (is_subdir(parent_dentry,node_ptr_h->dentry_blk))){
-                        spin_unlock(&rm->lock);
-                        printk("%s: vfs_unlink denied\n ", MODNAME);
-                        log_info = (struct log_info*) ri->data;
-                        exe_file = my_get_task_exe_file(current);
-                        if(!exe_file) return 1;
-                        log_info->pathname = node_ptr_h->path;
-                        log_info->task = current;
-    
-                        return 0;
-            }
-        }
+        node_ptr_h = lookup_ancestor_node_blacklist(rm, dentry); //the object itself or a protected directory containing it
+        if(node_ptr_h) goto deny;
 
 leave:
-    spin_unlock(&rm->lock);
+    rcu_read_unlock();
     return 1;
+deny:
+    printk("%s: vfs_unlink denied\n ", MODNAME);
+    return deny_operation(ri, node_ptr_h, RM_OP_UNLINK);
 }
 /* int security_inode_symlink(struct inode *dir, struct dentry *dentry, const char *old_name)
 
@@ -626,43 +968,29 @@ leave:
  * old_name contains the pathname of file. Return 0 if permission is granted.
 */
 int inode_symlink_pre_hook(struct kretprobe_instance  *ri, struct pt_regs *regs){
-    struct inode* old_inode;
-    //struct dentry* dentry = (struct dentry*)regs->si;
-    struct log_info* log_info;
-    char* old_name;
-    struct file* exe_file;
+    struct dentry* dentry;
+    const char* old_name;
     node* node_ptr_h;
-    struct list_head* ptr_h;
-    struct path path;
-    int error;
 
-    spin_lock(&rm->lock);
-    if(list_empty(&rm->blk_head_node->elem) || ((rm->state == REC_OFF || rm->state == OFF ))) goto leave;
-    //retrieve inode of symbolik link
-    old_name = (char*)regs->dx;
-    error = kern_path(old_name, LOOKUP_FOLLOW, &path);
-    if(error) goto leave;
-    
-    old_inode = path.dentry->d_inode; // retrive the inode associated to old_name pathname
-    //searching in the blacklist
-   list_for_each(ptr_h,&rm->blk_head_node->elem) {
-        node_ptr_h = (node*)list_entry(ptr_h, node, elem);
-        if(!node_ptr_h) goto leave;
-        if(old_inode->i_ino == node_ptr_h->inode_blk->i_ino ){ 
-                    spin_unlock(&rm->lock);
+    dentry = (struct dentry*)regs->si; //negative, its parent is dir (locked by the caller)
+    old_name = (const char*)regs->dx;
+
+    rcu_read_lock();
+    if(list_empty(&rm->blk_head_node->elem) || ((READ_ONCE(rm->state) == REC_OFF || READ_ONCE(rm->state) == OFF ))) goto leave;
+    /*the target is canonicalised and matched by name, it is not resolved (the hook can't walk paths).
+    A relative target may cross mounts, so every filesystem is concerned*/
+    node_ptr_h = lookup_symlink_node_blacklist(rm, dentry->d_parent, old_name);
+    if(IS_ERR(node_ptr_h)){
+        //a ".." out of the filesystem of dir or a path too long: where the target ends is not known, the link is allowed
+        printk_ratelimited("%s: vfs_symlink allowed, the target can't be checked (%ld)\n", MODNAME, PTR_ERR(node_ptr_h));
+        goto leave;
+    }
+    if(node_ptr_h){ 
                     printk("%s: vfs_symlink denied\n ", MODNAME);
-                    exe_file = my_get_task_exe_file(current);
-                    if(!exe_file) return 1;
-
-                    log_info = (struct log_info*) ri->data;
-                    log_info->pathname = node_ptr_h->path;
-                    log_info->task = current;
-
-                    return 0;
-        }
+                    return deny_operation(ri, node_ptr_h, RM_OP_SYMLINK);
     }
 leave:
-    spin_unlock(&rm->lock);
+    rcu_read_unlock();
     return 1;
 }
 /* int security_inode_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode) */
@@ -678,35 +1006,23 @@ leave:
  * */
 int inode_mkdir_pre_hook(struct kretprobe_instance  *ri, struct pt_regs *regs){
     struct inode* parent_inode;  
-    //struct dentry* dentry = (struct dentry*)regs->si;
-    struct log_info* log_info;
+    struct dentry* dentry;
     node* node_ptr_h;
-    struct list_head* ptr_h;
-    struct dentry* parent_dentry;
-    struct file* exe_file;
 
-    spin_lock(&rm->lock);
-    if(list_empty(&rm->blk_head_node->elem) || ((rm->state == REC_OFF || rm->state == OFF ))) goto leave;
     parent_inode = (struct inode*)regs->di;
-    parent_dentry = d_find_alias(parent_inode);
-   list_for_each(ptr_h,&rm->blk_head_node->elem) { 
-            node_ptr_h = (node*)list_entry(ptr_h, node, elem);
-            if(!node_ptr_h) goto leave;
-            if((parent_dentry->d_inode->i_ino == (get_parent_inode(node_ptr_h->inode_blk))->i_ino) || (is_subdir(parent_dentry,node_ptr_h->dentry_blk))){
-                        spin_unlock(&rm->lock);
-                        printk("%s: vfs_mkdir denied\n ", MODNAME);
-                        log_info = (struct log_info*) ri->data;
-                        exe_file = my_get_task_exe_file(current);
-                        if(!exe_file) return 1;
-                        log_info->pathname = node_ptr_h->path;
-                        log_info->task = current;
-    
-                        return 0;
-            }
-    }
+    if(!sb_has_rules(parent_inode->i_sb)) return 1;
+
+    rcu_read_lock();
+    if(list_empty(&rm->blk_head_node->elem) || ((READ_ONCE(rm->state) == REC_OFF || READ_ONCE(rm->state) == OFF ))) goto leave;
+    dentry = (struct dentry*)regs->si; //negative, its parent is parent_inode
+    node_ptr_h = lookup_ancestor_node_blacklist(rm, dentry); //protected directories containing the new one
+    if(node_ptr_h) goto deny;
 leave:
-    spin_unlock(&rm->lock);
+    rcu_read_unlock();
     return 1;
+deny:
+    printk("%s: vfs_mkdir denied\n ", MODNAME);
+    return deny_operation(ri, node_ptr_h, RM_OP_MKDIR);
 }
 /*int security_inode_rmdir(struct inode *dir, struct dentry *dentry) 
  * called in vfs_rmdir - remove directory
@@ -721,33 +1037,23 @@ leave:
 int inode_rmdir_pre_hook(struct kretprobe_instance  *ri, struct pt_regs *regs){
     //struct inode* parent_inode = (struct inode*)regs->di;
     struct dentry* dentry;
-    struct log_info* log_info;
-    struct file* exe_file;
+    struct inode* inode;
     node* node_ptr_h;
-    struct list_head* ptr_h;
 
-    spin_lock(&rm->lock);
-    if(list_empty(&rm->blk_head_node->elem) || ((rm->state == REC_OFF || rm->state == OFF ))) goto leave;
     dentry = (struct dentry*)regs->si;
-   list_for_each(ptr_h,&rm->blk_head_node->elem) {
-            node_ptr_h = (node*)list_entry(ptr_h, node, elem);
-            if(!node_ptr_h) goto leave;
-            if(dentry->d_inode->i_ino == node_ptr_h->inode_cod || (is_subdir(dentry,node_ptr_h->dentry_blk))){
-                        exe_file = my_get_task_exe_file(current);
-                        if(!exe_file) return 1;
-                        spin_unlock(&rm->lock);
-                        printk("%s: vfs_rmdir denied\n", MODNAME);
-                        log_info = (struct log_info*) ri->data;
-                       
-                        log_info->pathname = node_ptr_h->path;
-                        log_info->task = current;
-                        
-                        return 0;
-            }
-    }
+    inode = dentry->d_inode;
+    if(!sb_has_rules(inode->i_sb)) return 1;
+
+    rcu_read_lock();
+    if(list_empty(&rm->blk_head_node->elem) || ((READ_ONCE(rm->state) == REC_OFF || READ_ONCE(rm->state) == OFF ))) goto leave;
+    node_ptr_h = lookup_ancestor_node_blacklist(rm, dentry); //the directory itself or a protected directory containing it
+    if(node_ptr_h) goto deny;
 leave:
-    spin_unlock(&rm->lock);
+    rcu_read_unlock();
     return 1;
+deny:
+    printk("%s: vfs_rmdir denied\n", MODNAME);
+    return deny_operation(ri, node_ptr_h, RM_OP_RMDIR);
 }
 
 /* int security_inode_mknod(struct inode *dir, struct dentry *dentry, umode_t mode, dev_t dev)*/
@@ -765,33 +1071,24 @@ leave:
  */
 int inode_mknod_pre_hook(struct kretprobe_instance  *ri, struct pt_regs *regs){
     struct inode* inode;
-    struct log_info *log_info;
+    struct dentry* dentry;
     node* node_ptr_h;
-    struct file* exe_file;
-    struct list_head* ptr_h;
 
-    spin_lock(&rm->lock);
-    if(list_empty(&rm->blk_head_node->elem) || ((rm->state == REC_OFF || rm->state == OFF ))) goto leave;
     inode = (struct inode*)regs->di;
-   list_for_each(ptr_h,&rm->blk_head_node->elem) {
-            node_ptr_h = (node*)list_entry(ptr_h, node, elem);
-            if(!node_ptr_h) goto leave;
-            if(inode->i_ino == node_ptr_h->inode_cod || (is_subdir(d_find_alias(inode),node_ptr_h->dentry_blk))){
-                        spin_unlock(&rm->lock);
-                        printk("%s: vfs_mknod denied\n ", MODNAME);
-                        log_info = (struct log_info*) ri->data;
-                        exe_file = my_get_task_exe_file(current);
-                        if(!exe_file) return 1;
-                        log_info->pathname = node_ptr_h->path;
-                        log_info->task = current;
-    
-                        return 0;
-            }
-    }
+    if(!sb_has_rules(inode->i_sb)) return 1;
+
+    rcu_read_lock();
+    if(list_empty(&rm->blk_head_node->elem) || ((READ_ONCE(rm->state) == REC_OFF || READ_ONCE(rm->state) == OFF ))) goto leave;
+    dentry = (struct dentry*)regs->si; //negative, its parent is inode
+    node_ptr_h = lookup_ancestor_node_blacklist(rm, dentry); //protected directories containing the object
+    if(node_ptr_h) goto deny;
 
 leave:
-    spin_unlock(&rm->lock);
+    rcu_read_unlock();
     return 1;
+deny:
+    printk("%s: vfs_mknod denied\n ", MODNAME);
+    return deny_operation(ri, node_ptr_h, RM_OP_MKNOD);
 }
 
 /*int security_inode_rename(struct inode *old_dir, struct dentry *old_dentry,struct inode *new_dir, struct dentry *new_dentry, unsigned int flags) 
@@ -804,37 +1101,26 @@ leave:
  * */
 int inode_rename_pre_hook(struct kretprobe_instance  *ri, struct pt_regs *regs){
     struct  dentry* old_dentry;
-    struct log_info *log_info;
     //struct dentry* new_dentry = (struct dentry*)regs->cx;
     struct inode* old_inode;
     //struct inode* new_inode = new_dentry->d_inode;
     node* node_ptr_h;
-    struct list_head* ptr_h;
-    struct file* exe_file;
-
-    spin_lock(&rm->lock);
-    if(list_empty(&rm->blk_head_node->elem) || ((rm->state == REC_OFF || rm->state == OFF ))) goto leave;
 
     old_dentry = (struct dentry*)regs->si;
     old_inode = old_dentry->d_inode;
+    if(!inode_maybe_protected(old_inode)) return 1;
+    if(!sb_has_rules(old_inode->i_sb)) return 1;
+
+    rcu_read_lock();
+    if(list_empty(&rm->blk_head_node->elem) || ((READ_ONCE(rm->state) == REC_OFF || READ_ONCE(rm->state) == OFF ))) goto leave;
 
-   list_for_each(ptr_h,&rm->blk_head_node->elem) {
-            node_ptr_h = (node*)list_entry(ptr_h, node, elem);
-            if(!node_ptr_h) goto leave;
-            if(old_inode->i_ino == node_ptr_h->inode_cod){
-                        spin_unlock(&rm->lock);
+    node_ptr_h = lookup_inode_node_blacklist(rm, old_inode->i_sb->s_dev, old_inode->i_ino);
+    if(node_ptr_h){
                         printk("%s: vfs_rename denied\n ", MODNAME);
-                        log_info = (struct log_info*) ri->data;
-                        exe_file = my_get_task_exe_file(current);
-                        if(!exe_file) return 1;
-                        log_info->pathname = node_ptr_h->path;
-                        log_info->task = current;
-    
-                        return 0;          
-            }
+                        return deny_operation(ri, node_ptr_h, RM_OP_RENAME);
     }
 leave:
-    spin_unlock(&rm->lock);
+    rcu_read_unlock();
     return 1;
 }
 
@@ -852,37 +1138,25 @@ leave:
  */
 int inode_setattr_pre_hook(struct kretprobe_instance  *ri, struct pt_regs *regs){
     struct dentry* dentry;
+    struct inode* inode;
     node * node_ptr_h;
-    struct log_info* log_info;
-    struct list_head *ptr_h;
-    struct file* exe_file;
-    unsigned long i_ino;
 
-    spin_lock(&rm->lock);
-    
-    if(list_empty(&rm->blk_head_node->elem) || ((rm->state == REC_OFF || rm->state == OFF ))) goto leave;
     dentry = (struct dentry*)regs->di;
-    i_ino = dentry->d_inode->i_ino;
-   list_for_each(ptr_h,&rm->blk_head_node->elem) {
-            node_ptr_h = (node*)list_entry(ptr_h, node, elem);
-            if(!node_ptr_h) goto leave;
-            if(i_ino == node_ptr_h->inode_cod || is_subdir(dentry,node_ptr_h->dentry_blk)){
-                        spin_unlock(&rm->lock);
-                        printk("%s: chmod denied\n", MODNAME);
-                        log_info = (struct log_info*) ri->data;
-                        exe_file = my_get_task_exe_file(current);
-                        if(!exe_file) return 1;
-                        log_info->pathname = node_ptr_h->path;
-                        log_info->task = current;
-
-                        
-                        return 0;
-            }
-    }
+    inode = dentry->d_inode;
+    if(!sb_has_rules(inode->i_sb)) return 1;
+
+    rcu_read_lock();
+    
+    if(list_empty(&rm->blk_head_node->elem) || ((READ_ONCE(rm->state) == REC_OFF || READ_ONCE(rm->state) == OFF ))) goto leave;
+    node_ptr_h = lookup_ancestor_node_blacklist(rm, dentry); //the object itself or a protected directory containing it
+    if(node_ptr_h) goto deny;
 
 leave:
-    spin_unlock(&rm->lock);
+    rcu_read_unlock();
     return 1;
+deny:
+    printk("%s: chmod denied\n", MODNAME);
+    return deny_operation(ri, node_ptr_h, RM_OP_SETATTR);
 }
 
 /* The_hook function is the exit handler shared among all the kretprobes.
@@ -910,10 +1184,18 @@ the program path-name that is currently attempting the open
 a cryptographic hash of the program file content
 */
 
+/*aggregation mode: writes the summary of the last interval and rearms itself*/
+static void aggr_flush_handler(struct work_struct* work){
+    mutex_lock(&rm->log_mutex);
+    log_aggr_flush(rm, false);
+    mutex_unlock(&rm->log_mutex);
+    schedule_delayed_work(&rm->log_aggr.flush_work, aggr_interval * HZ);
+}
+
 void deferred_logger_handler(struct work_struct* data){ 
     packed_work *pkd_w;
-    char line[4096];
-    int ret;
+    const char* program;
+    int ret, len;
 
     pkd_w = (packed_work*) container_of(data, packed_work , work);
     
@@ -921,10 +1203,13 @@ void deferred_logger_handler(struct work_struct* data){
         printk("%s: packed_work not retrieved\n", MODNAME);
         return;
     }
-    //compute fingerprint task's executable file
-    pkd_w->log_info->file_content_hash = file_content_fingerprint(pkd_w->log_info->task); 
+    //compute fingerprint task's executable file, in aggregation mode only for a new key (log_aggr_account)
+    pkd_w->log_info->file_content_hash = NULL;
+    if(rm->log_mode != LOG_MODE_AGGR)
+        pkd_w->log_info->file_content_hash = file_content_fingerprint(pkd_w->log_info->fp_executable); 
 
-    if(!(pkd_w->log_info->file_content_hash)){
+    if(rm->log_mode != LOG_MODE_AGGR && !(pkd_w->log_info->file_content_hash)){
+        fput(pkd_w->log_info->fp_executable);
         kfree(pkd_w->log_info->pathname);
         kfree(pkd_w->log_info);
         kfree(pkd_w);
@@ -932,8 +1217,17 @@ void deferred_logger_handler(struct work_struct* data){
     }
     //write the various information into the (unique) log file
 
-    sprintf(line, "pathname: %s, file content hash: %s, tgid: %d, tid: %d, effective uid: %d, real uid: %d\n", pkd_w->log_info->pathname,pkd_w->log_info->file_content_hash,pkd_w->log_info->tgid, pkd_w->log_info->tid, pkd_w->log_info->effect_uid, pkd_w->log_info->real_uid);
-    ret = kernel_write(rm->log_file, line, strlen(line), &rm->log_file->f_pos);
+    mutex_lock(&rm->log_mutex);
+    if(rm->log_mode == LOG_MODE_AGGR && !log_aggr_account(&rm->log_aggr, pkd_w->log_info)){
+        len = ret = 0; //reported by the next summary, or program not hashed
+    }else{
+        program = exe_path_get(rm->exe_cache, pkd_w->log_info->fp_executable);
+        len = format_log_record(rm, pkd_w->log_info, program, rm->log_buf, LOG_BUF_SIZE);
+        exe_path_put(rm->exe_cache);
+        ret = kernel_write(rm->log_file, rm->log_buf, len, &rm->log_file->f_pos);
+    }
+    mutex_unlock(&rm->log_mutex);
+    fput(pkd_w->log_info->fp_executable);
     
     if(pkd_w->log_info->file_content_hash)
         kfree(pkd_w->log_info->file_content_hash);
@@ -943,7 +1237,7 @@ void deferred_logger_handler(struct work_struct* data){
         kfree(pkd_w->log_info);
     if(pkd_w)
         kfree(pkd_w);
-    if(ret != strlen(line))
+    if(ret != len)
         printk(KERN_ERR "%s: Failed to write into the log file!!: bytes written are %d\n", MODNAME, ret);
         
     return;
@@ -952,6 +1246,7 @@ void deferred_logger_handler(struct work_struct* data){
 int init_module(void) {
     unsigned long ** sys_call_table;
     char* digest_crypto_hash;
+    int i;
    
     /* initializing struct ref_mon rm */
     rm =  kmalloc(sizeof(ref_mon), GFP_KERNEL); //alloc memory in kernel space
@@ -982,6 +1277,67 @@ int init_module(void) {
     rm->blk_head_node = kmalloc(sizeof(node), GFP_ATOMIC);
     rm->state = OFF;// init state of reference monitor
     INIT_LIST_HEAD(&rm->blk_head_node->elem); //blacklist initialization
+    hash_init(rm->blk_index);
+    hash_init(rm->blk_names[0].index);
+    hash_init(rm->blk_names[1].index);
+    rm->blk_count = 0;
+    rm->nr_dir_rules = 0;
+    INIT_WORK(&rm->probe_work, probe_work_handler);
+    INIT_WORK(&rm->rename_work, blk_rename_work);
+    memset(rm->sb_rules, 0, sizeof(rm->sb_rules));
+    rm->sb_overflow = 0;
+    spin_lock_init(&rm->lock);
+    mutex_init(&rm->blk_mutex);
+    path_arena_init(&rm->path_arena);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+    rm->notify_group = fsnotify_alloc_group(&blk_fsnotify_ops, 0);
+#else
+    rm->notify_group = fsnotify_alloc_group(&blk_fsnotify_ops);
+#endif
+    if(IS_ERR(rm->notify_group)) {
+        printk(KERN_ERR "%s: creation of the fsnotify group failed\n", MODNAME);
+        return PTR_ERR(rm->notify_group);
+    }
+    rm->log_mode = log_mode <= LOG_MODE_AGGR ? log_mode : LOG_MODE_TEXT;
+    RCU_INIT_POINTER(rm->log_filter, NULL);
+    rm->filter_stats = &filter_stats;
+    mutex_init(&rm->log_mutex);
+    log_dict_init(&rm->log_dict);
+    log_aggr_init(&rm->log_aggr);
+    INIT_DELAYED_WORK(&rm->log_aggr.flush_work, aggr_flush_handler);
+    rm->log_buf = kmalloc(LOG_BUF_SIZE, GFP_KERNEL);
+    if(!rm->log_buf) {
+        printk(KERN_ERR "%s: allocation of the log buffer failed\n", MODNAME);
+        return -ENOMEM;
+    }
+    if(rm->log_mode == LOG_MODE_DICT) {
+        //the ids written by a previous instance are not valid anymore
+        int len = log_dict_reset(&rm->log_dict, rm->log_buf, LOG_BUF_SIZE);
+        kernel_write(rm->log_file, rm->log_buf, len, &rm->log_file->f_pos);
+    }
+    if(rm->log_mode == LOG_MODE_AGGR) {
+        if(!aggr_interval) aggr_interval = AGGR_DEFAULT_INTERVAL;
+        schedule_delayed_work(&rm->log_aggr.flush_work, aggr_interval * HZ);
+    }
+    rm->hook_buf = alloc_percpu(struct hook_buf);
+    if(!rm->hook_buf) {
+        printk(KERN_ERR "%s: allocation of the hook buffers failed\n", MODNAME);
+        return -ENOMEM;
+    }
+    rm->exe_cache = &exe_cache;
+    if(exe_path_cache_init(rm->exe_cache)) {
+        printk(KERN_ERR "%s: creation of the program path cache failed\n", MODNAME);
+        return -ENOMEM;
+    }
+    if(bloom_init(&rm->bloom, bloom_bits, bloom_hashes)) {
+        printk(KERN_ERR "%s: creation of the blacklist prefilter failed\n", MODNAME);
+        return -EINVAL;
+    }
+    rm->node_cache = kmem_cache_create("rm_blacklist_node", sizeof(node), 0, 0, NULL);
+    if(unlikely(!rm->node_cache)) {
+        printk(KERN_ERR "%s: creation of the node cache failed\n", MODNAME);
+        return -ENOMEM;
+    }
    
     rm->queue_work = alloc_workqueue("REFERENCE_MONITOR_WORKQUEUE", WQ_MEM_RECLAIM, 1); // create an unique workqueue 
     if(unlikely(!rm->queue_work)) {
@@ -1001,6 +1357,9 @@ int init_module(void) {
     security_inode_rename_probe.kp.symbol_name = security_inode_rename_hook_name;
     security_inode_setattr_probe.kp.symbol_name = security_inode_setattr_hook_name;
     
+    //registered disarmed: the monitor starts OFF with an empty blacklist
+    for(i = 0; i < RM_NR_OPS; i++)
+        rm_probes[i].krp->kp.flags |= KPROBE_FLAG_DISABLED;
     set_kretprobe(&security_file_open_probe);
     set_kretprobe(&security_inode_create_probe);
     set_kretprobe(&security_inode_link_probe);
@@ -1022,6 +1381,8 @@ int init_module(void) {
         sys_call_table[free_entries[1]] = (unsigned long*)sys_add_path_blacklist;
         sys_call_table[free_entries[2]] = (unsigned long*)sys_remove_path_blacklist;
         sys_call_table[free_entries[3]] = (unsigned long*)sys_print_blacklist;
+        sys_call_table[free_entries[4]] = (unsigned long*)sys_remove_paths_blacklist;
+        sys_call_table[free_entries[5]] = (unsigned long*)sys_set_log_filter;
         protect_memory();
     }else{
         printk("%s: system call table not avalaible\n", MODNAME);
@@ -1036,9 +1397,7 @@ int init_module(void) {
 
 void cleanup_module(void) {
     unsigned long ** sys_call_table;
-    struct list_head* pos = NULL;
-    struct list_head* tmp;
-    node* node_ptr;
+    node *node_ptr, *tmp;
     /*restore system call table*/
     cr0 = read_cr0();
     unprotect_memory();
@@ -1047,8 +1406,18 @@ void cleanup_module(void) {
     sys_call_table[free_entries[1]] = nisyscall;
     sys_call_table[free_entries[2]] = nisyscall;
     sys_call_table[free_entries[3]] = nisyscall;
+    sys_call_table[free_entries[4]] = nisyscall;
+    sys_call_table[free_entries[5]] = nisyscall;
     protect_memory();   
    
+    //the blacklist is emptied first, so that fsnotify no longer queues probe_work and rename_work
+    spin_lock(&rm->lock);
+    list_for_each_entry_safe(node_ptr, tmp, &rm->blk_head_node->elem, elem)
+        remove_node_blacklist(rm, node_ptr);
+    spin_unlock(&rm->lock);
+    cancel_work_sync(&rm->probe_work);
+    cancel_work_sync(&rm->rename_work);
+
     /* unregistering kretprobes*/
     unregister_kretprobe(&security_inode_create_probe);
     unregister_kretprobe(&security_file_open_probe);
@@ -1060,25 +1429,35 @@ void cleanup_module(void) {
     unregister_kretprobe(&security_inode_mknod_probe);
     unregister_kretprobe(&security_inode_rename_probe);
     unregister_kretprobe(&security_inode_setattr_probe);
+    WRITE_ONCE(armed_ops, 0);
     
     /*releasing resources*/
+    fsnotify_destroy_group(rm->notify_group); //detaches every mark, the nodes are freed after a grace period
+    rcu_barrier();
+    kfree(rm->blk_head_node);
+    kmem_cache_destroy(rm->node_cache);
+    path_arena_destroy(&rm->path_arena);
+    bloom_destroy(&rm->bloom);
+    free_percpu(rm->hook_buf);
+
     if(likely(rm->queue_work))
         destroy_workqueue(rm->queue_work); 
+    cancel_delayed_work_sync(&rm->log_aggr.flush_work);
+    kfree(rcu_dereference_protected(rm->log_filter, 1)); //the probes are gone and rcu_barrier() waited the readers
+    WRITE_ONCE(nr_log_filters, 0);
+    log_aggr_flush(rm, true); //last summary
+    exe_path_cache_destroy(rm->exe_cache);
+    log_dict_reset(&rm->log_dict, rm->log_buf, LOG_BUF_SIZE);
+    kfree(rm->log_buf);
     if(likely(rm->pw_hash))
         kfree(rm->pw_hash);
     if(likely(rm->log_file)) {
         filp_close(rm->log_file, NULL);
     }
 
-    list_for_each_safe(pos, tmp, &rm->blk_head_node->elem) {
-        list_del(pos);
-        node_ptr = container_of(pos,node,elem);
-        kfree(node_ptr->path);
-        kfree(node_ptr);
-    }
-
     if(likely(rm))
         kfree(rm);
+    rm = NULL;
 
     printk("%s: shutting down\n",MODNAME);
 }
@@ -1,6 +1,8 @@
 #include <linux/key.h>
 #include <linux/crypto.h>
 #include <crypto/hash.h>
+#include <linux/hash.h>
+#include <linux/mm.h>
 #include "./../referenceMonitor.h"
 
 /*is used for compute password hash*/
@@ -34,17 +36,15 @@ int calculate_crypto_hash(const char *content, int size_content, unsigned char*
 
     return ret;
 }
-/*Is used for compute file content hash*/
-char *file_content_fingerprint(struct task_struct* task) {
+/*Is used for compute file content hash, the caller owns the reference to file*/
+char *file_content_fingerprint(struct file* file) {
         struct crypto_shash *hash_tfm;
-        struct file *file;
-        struct shash_desc *desc;
-        unsigned char *digest;
+        struct shash_desc *desc = NULL;
+        unsigned char *digest = NULL;
         char *result = NULL;
         loff_t pos = 0;
         int ret, i;
 
-        file = my_get_task_exe_file(task);
         if(!file){
             return NULL;
         }
@@ -96,8 +96,6 @@ out:
                 kfree(digest);
         if (desc)
                 kfree(desc);
-        if (file)
-                filp_close(file, NULL);
         if (hash_tfm)
                 crypto_free_shash(hash_tfm);
 
@@ -152,30 +150,818 @@ char* password_hash(char* pw, int size){
     return result;
 }
 
-node* lookup_inode_node_blacklist(struct inode* inode, struct list_head* head){
+/*lookup of a blacklist node by (dev, ino): the caller holds rm->lock or is inside an RCU read-side section.
+The index is not touched when the prefilter excludes the key*/
+node* lookup_inode_node_blacklist(ref_mon* rm, dev_t dev, unsigned long i_ino){
     node* node_ptr;
-    struct list_head* ptr;
-    list_for_each(ptr, head) {
-            node_ptr = list_entry(ptr, node, elem);
-            if(node_ptr->inode_cod == inode->i_ino){                
+    u64 key = blk_key(dev, i_ino);
+
+    if(!bloom_may_contain(&rm->bloom, key)) return NULL;
+    hash_for_each_possible_rcu(rm->blk_index, node_ptr, hnode, key) {
+            if(node_ptr->inode_cod == i_ino && node_ptr->dev == dev){                
                 return node_ptr;
             }
     }
+    this_cpu_inc(rm->bloom.stats->false_positives);
+    return NULL;
+}
+
+/*looks for dentry, or one of its ancestors, in the blacklist: it is the is_subdir() check
+against every directory of the blacklist, done with one index lookup per path component.
+The caller is inside an RCU read-side section*/
+node* lookup_ancestor_node_blacklist(ref_mon* rm, struct dentry* dentry){
+    struct dentry* d;
+    struct inode* inode;
+    node* node_ptr;
+    unsigned seq;
+
+    if(!dentry) return NULL;
+    do {
+        seq = read_seqbegin(&rename_lock); //a concurrent rename may move the walk on another branch
+        node_ptr = NULL;
+        d = dentry;
+        for(;;){
+            inode = READ_ONCE(d->d_inode);
+            if(inode){
+                node_ptr = lookup_inode_node_blacklist(rm, inode->i_sb->s_dev, inode->i_ino);
+                if(node_ptr) break;
+            }
+            if(IS_ROOT(d)) break;
+            d = READ_ONCE(d->d_parent);
+        }
+    } while(read_seqretry(&rename_lock, seq));
+    return node_ptr;
+}
+
+/*path of the protected object under the root of its filesystem, read from its first dentry:
+it follows the renames of the object and of its ancestors. The caller holds rm->lock or is inside
+an RCU read-side section; NULL if the object has no name any more or the path does not fit*/
+char* node_fs_path(node* node_ptr, char* buf, int size){
+    struct inode* inode = node_ptr->inode_blk;
+    struct dentry* alias;
+    char* p = NULL;
+
+    spin_lock(&inode->i_lock); //the alias can't be dropped meanwhile
+    hlist_for_each_entry(alias, &inode->i_dentry, d_u.d_alias){
+        p = dentry_path_raw(alias, buf, size);
+        break;
+    }
+    spin_unlock(&inode->i_lock);
+    return IS_ERR_OR_NULL(p) ? NULL : p;
+}
+
+/*current absolute path of the protected object: the mount prefix recorded at insertion followed
+by the position of the object under the mount root. An object moved out of the subtree shown by
+the mount gets the path under the root of its filesystem. Same rules as node_fs_path*/
+char* node_current_path(node* node_ptr, char* buf, int size){
+    const char* root = node_ptr->path + node_ptr->path_len + 1;
+    char* p = node_fs_path(node_ptr, buf, size);
+    char* below;
+
+    if(!p) return NULL;
+    below = p + node_ptr->root_len;
+    if(node_ptr->root_len && (strncmp(p, root, node_ptr->root_len) || (*below && *below != '/')))
+        return p;
+    if(!strcmp(below, "/") && node_ptr->mnt_off)
+        below++; //the root of the mount is named by the prefix alone
+    if(below - buf < node_ptr->mnt_off) return NULL;
+    memcpy(below - node_ptr->mnt_off, node_ptr->path, node_ptr->mnt_off);
+    return below - node_ptr->mnt_off;
+}
+
+/*lexical canonical form of a symlink target, built in buf->target without resolving anything:
+empty and "." components are dropped, ".." removes the component before it. Both kinds of target
+are placed under the root of a filesystem: an absolute one after the path of the root of the caller
+(not "/" in a chroot), a relative one after the path of dir, and ".." never climbs above the root
+of the caller. Returns the length of the path, -EXDEV if a ".." leaves the filesystem of dir through
+its root (towards a mountpoint the hook can't see). buf->path is used as scratch*/
+static int canonical_target(struct dentry* dir, const char* target, struct hook_buf* buf){
+    struct dentry* root = current->fs->root.dentry;
+    const int size = sizeof(buf->target);
+    char* t = buf->target;
+    const char *c, *end;
+    char *p, *r;
+    int len, n, floor;
+    bool at_root; //a ".." at floor stays there, floor is the root of the caller
+
+    r = dentry_path_raw(root, buf->path, sizeof(buf->path));
+    if(IS_ERR(r)) return PTR_ERR(r);
+    n = strlen(r);
+    if(target[0] == '/'){
+        memcpy(t, r, n + 1);
+        len = n;
+        at_root = true;
+    }
+    else {
+        p = dentry_path_raw(dir, t, size);
+        if(IS_ERR(p)) return PTR_ERR(p);
+        len = strlen(p);
+        memmove(t, p, len + 1);
+        at_root = root->d_sb == dir->d_sb && !strncmp(t, r, n) && (n == 1 || !t[n] || t[n] == '/');
+    }
+    floor = at_root ? n : 1;
+    for(c = target; *c; c = end){
+        while(*c == '/') c++;
+        end = strchrnul(c, '/');
+        n = end - c;
+        if(!n || (n == 1 && c[0] == '.')) continue;
+        if(n == 2 && c[0] == '.' && c[1] == '.'){
+            if(len > floor){
+                while(t[--len] != '/');
+                len = max(len, floor);
+            }
+            else if(!at_root)
+                return -EXDEV;
+            continue;
+        }
+        if(len + 1 + n >= size) return -ENAMETOOLONG;
+        if(len > 1) t[len++] = '/';
+        memcpy(t + len, c, n);
+        len += n;
+    }
+    t[len] = '\0';
+    return len;
+}
+
+/*true if the canonical target a ends with the rule path b: an object reached through a mount
+has a path ending with its path in the filesystem. b starts with '/', so the part compared starts
+on a component boundary of a*/
+static bool path_suffix_match(const char* a, int alen, const char* b){
+    int blen = strlen(b);
+
+    return alen >= blen && !memcmp(a + alen - blen, b, blen);
+}
+
+//true if the canonical target t names the protected object, by its path in the filesystem or by its absolute path
+static bool node_is_target(node* node_ptr, const char* t, int len, struct hook_buf* buf){
+    char* p = node_fs_path(node_ptr, buf->path, sizeof(buf->path));
+
+    if(p && path_suffix_match(t, len, p)) return true;
+    p = node_current_path(node_ptr, buf->path, sizeof(buf->path));
+    return p && path_suffix_match(t, len, p);
+}
+
+/*looks for the object a symlink created in dir would point to, without resolving target: the
+target is canonicalised (canonical_target) and the rules having its last component as name are
+compared with it (node_is_target). Returns ERR_PTR() if the target can't be canonicalised: it
+leaves the filesystem of dir (-EXDEV) or it is too long, no rule can be told apart then.
+The caller is a pre-hook, inside an RCU read-side section*/
+node* lookup_symlink_node_blacklist(ref_mon* rm, struct dentry* dir, const char* target){
+    struct hook_buf* buf = this_cpu_ptr(rm->hook_buf);
+    struct dentry* root;
+    const char* last;
+    node* node_ptr;
+    int len;
+    u32 key;
+
+    len = canonical_target(dir, target, buf);
+    if(len < 0) return ERR_PTR(len);
+    if(len == 1){
+        //the root of the caller or of the filesystem of dir, which has no name
+        root = target[0] == '/' ? current->fs->root.dentry : dir->d_sb->s_root;
+        return lookup_inode_node_blacklist(rm, root->d_sb->s_dev, d_inode(root)->i_ino);
+    }
+    last = strrchr(buf->target, '/') + 1;
+    key = blk_name_key(last, buf->target + len - last);
+    hash_for_each_possible_rcu(rm->blk_names[0].index, node_ptr, name_hnode[0], key)
+        if(node_is_target(node_ptr, buf->target, len, buf)) return node_ptr;
+    hash_for_each_possible_rcu(rm->blk_names[1].index, node_ptr, name_hnode[1], key)
+        if(node_is_target(node_ptr, buf->target, len, buf)) return node_ptr;
     return NULL;
 }
 
+/*unlinks the node from the blacklist, it must be called with rm->lock held.
+The hooks can still be walking the node: the memory is released by the free_mark callback
+one grace period after the inode mark has been dropped*/
+void remove_node_blacklist(ref_mon* rm, node* node_ptr){
+    hash_del_rcu(&node_ptr->hnode);
+    hash_del_rcu(&node_ptr->name_hnode[node_ptr->name_slot]);
+    list_del_rcu(&node_ptr->elem);
+    bloom_del(&rm->bloom, blk_key(node_ptr->dev, node_ptr->inode_cod));
+    if(S_ISDIR(node_ptr->inode_blk->i_mode))
+        rm->nr_dir_rules--;
+    sb_rules_put(rm, node_ptr->inode_blk->i_sb);
+    rm->blk_count--;
+}
+
+/*detaches the inode mark of a node already removed from the blacklist (it may sleep). The caller
+holds a reference to the mark taken while the node was still hashed, which is dropped here*/
+void release_node_blacklist(ref_mon* rm, node* node_ptr){
+    fsnotify_destroy_mark(&node_ptr->fsn_mark, rm->notify_group);
+    fsnotify_put_mark(&node_ptr->fsn_mark);
+}
+
+static void free_node_rcu(struct rcu_head* head){
+    node* node_ptr = container_of(head, node, rcu);
+
+    path_arena_free(&rm->path_arena, node_ptr->path, node_ptr->path_len + 1 + node_ptr->root_len);
+    kmem_cache_free(rm->node_cache, node_ptr);
+}
+
+/*the protected inode has been deleted, its filesystem unmounted or the rule removed:
+the node leaves the blacklist (if a system call did not already unlink it)*/
+static void blk_freeing_mark(struct fsnotify_mark* mark, struct fsnotify_group* group){
+    node* node_ptr = container_of(mark, node, fsn_mark);
+
+    spin_lock(&rm->lock);
+    if(!hlist_unhashed(&node_ptr->hnode)){
+        printk("%s: the object protected as %s no longer exists, rule dropped\n", MODNAME, node_ptr->path);
+        remove_node_blacklist(rm, node_ptr);
+        queue_work(system_wq, &rm->probe_work); //the probes are switched under rm->blk_mutex, which may be held by the caller
+    }
+    spin_unlock(&rm->lock);
+}
+
+static void blk_free_mark(struct fsnotify_mark* mark){
+    node* node_ptr = container_of(mark, node, fsn_mark);
+
+    call_rcu(&node_ptr->rcu, free_node_rcu);
+}
+
+/*hashes the node under the last component of its current path, called with rm->lock held. It is
+added to the other index before leaving this one, so a concurrent lookup finds it in either; the
+link left can be used again once the lookups that may walk it are over (name_retired)*/
+static void blk_rehash_node(node* node_ptr){
+    struct hook_buf* buf = this_cpu_ptr(rm->hook_buf); //preemption is disabled by rm->lock
+    unsigned int slot = !node_ptr->name_slot;
+    char* p = node_current_path(node_ptr, buf->path, sizeof(buf->path));
+
+    if(!p) return;
+    p = strrchr(p, '/') + 1;
+    hash_add_rcu(rm->blk_names[slot].index, &node_ptr->name_hnode[slot], blk_name_key(p, strlen(p)));
+    hash_del_rcu(&node_ptr->name_hnode[node_ptr->name_slot]);
+    node_ptr->name_slot = slot;
+    node_ptr->name_retired = get_state_synchronize_rcu();
+}
+
+/*the protected object has been renamed: the node is hashed again under its new name. The hooks
+and the logger read its path from the dentry tree, so nothing else is kept up to date here, and the
+renames of its ancestors (which are not notified) need nothing. The event comes from the process
+that did the rename, with the directories still locked: it never waits for a grace period, a node
+renamed again within one is left to rename_work*/
+static void blk_rename_node(node* node_ptr){
+    spin_lock(&rm->lock);
+    if(!hlist_unhashed(&node_ptr->hnode)){
+        if(poll_state_synchronize_rcu(node_ptr->name_retired)){
+            node_ptr->name_stale = false;
+            blk_rehash_node(node_ptr);
+        }
+        else {
+            node_ptr->name_stale = true;
+            queue_work(system_wq, &rm->rename_work);
+        }
+    }
+    spin_unlock(&rm->lock);
+}
+
+//rehashes the nodes whose rename found the other link still in use
+void blk_rename_work(struct work_struct* work){
+    node* node_ptr;
+    bool again = false;
+
+    synchronize_rcu(); //the links retired before the renames are free now
+    spin_lock(&rm->lock);
+    list_for_each_entry(node_ptr, &rm->blk_head_node->elem, elem){
+        if(!node_ptr->name_stale) continue;
+        if(poll_state_synchronize_rcu(node_ptr->name_retired)){
+            node_ptr->name_stale = false;
+            blk_rehash_node(node_ptr);
+        }
+        else
+            again = true;
+    }
+    spin_unlock(&rm->lock);
+    if(again)
+        queue_work(system_wq, &rm->rename_work);
+}
+
+static int blk_handle_inode_event(struct fsnotify_mark* mark, u32 mask, struct inode* inode, struct inode* dir, const struct qstr* file_name, u32 cookie){
+    if(mask & FS_MOVE_SELF)
+        blk_rename_node(container_of(mark, node, fsn_mark));
+    return 0;
+}
+
+const struct fsnotify_ops blk_fsnotify_ops = {
+    .handle_inode_event = blk_handle_inode_event,
+    .freeing_mark = blk_freeing_mark,
+    .free_mark = blk_free_mark,
+};
+
+/*accounts a new rule on sb, called with rm->lock held. A superblock gets a slot only while
+sb_overflow is zero, so all the rules of a superblock in sb_rules are counted by its slot*/
+void sb_rules_get(ref_mon* rm, struct super_block* sb){
+    struct sb_rules* free_slot = NULL;
+    int i;
+
+    for(i = 0; i < BLK_MAX_SB; i++){
+        if(rm->sb_rules[i].sb == sb){
+            rm->sb_rules[i].nr_rules++;
+            return;
+        }
+        if(!rm->sb_rules[i].sb && !free_slot)
+            free_slot = &rm->sb_rules[i];
+    }
+    if(!free_slot || rm->sb_overflow){
+        WRITE_ONCE(rm->sb_overflow, rm->sb_overflow + 1);
+        return;
+    }
+    free_slot->nr_rules = 1;
+    WRITE_ONCE(free_slot->sb, sb);
+}
+
+//drops a rule on sb, called with rm->lock held
+void sb_rules_put(ref_mon* rm, struct super_block* sb){
+    int i;
+
+    for(i = 0; i < BLK_MAX_SB; i++){
+        if(rm->sb_rules[i].sb != sb) continue;
+        if(--rm->sb_rules[i].nr_rules == 0)
+            WRITE_ONCE(rm->sb_rules[i].sb, NULL);
+        return;
+    }
+    WRITE_ONCE(rm->sb_overflow, rm->sb_overflow - 1);
+}
+
+const char* const rm_op_name[RM_NR_OPS] = {
+    [RM_OP_OPEN] = "open",
+    [RM_OP_CREATE] = "create",
+    [RM_OP_LINK] = "link",
+    [RM_OP_UNLINK] = "unlink",
+    [RM_OP_SYMLINK] = "symlink",
+    [RM_OP_RMDIR] = "rmdir",
+    [RM_OP_MKDIR] = "mkdir",
+    [RM_OP_MKNOD] = "mknod",
+    [RM_OP_RENAME] = "rename",
+    [RM_OP_SETATTR] = "setattr",
+};
+
+/*true if the denial of op on the node must not be logged. Called by the pre-hooks inside
+an RCU read-side section, costs a load when no filter exists for op*/
+bool log_filter_match(ref_mon* rm, node* node_ptr, enum rm_op op){
+    struct log_filter* filter = rcu_dereference(rm->log_filter);
+    const struct cred* cred;
+    struct log_filter_rule* rule;
+    struct file* exe_file;
+    struct inode* exe_inode = NULL;
+    unsigned int i;
+
+    if(!filter || !(filter->ops & BIT(op))) return false;
+    cred = current_cred();
+    if(current->mm && (exe_file = rcu_dereference(current->mm->exe_file)))
+        exe_inode = file_inode(exe_file);
+    for(i = 0; i < filter->nr_rules; i++){
+        rule = &filter->rules[i];
+        if(!(rule->ops & BIT(op))) continue;
+        if((rule->fields & FILTER_UID) && rule->uid != from_kuid(&init_user_ns, cred->uid)) continue;
+        if((rule->fields & FILTER_EUID) && rule->euid != from_kuid(&init_user_ns, cred->euid)) continue;
+        if((rule->fields & FILTER_EXE) && (!exe_inode || rule->exe_ino != exe_inode->i_ino || rule->exe_dev != exe_inode->i_sb->s_dev)) continue;
+        if((rule->fields & FILTER_RULE) && (rule->rule_ino != node_ptr->inode_cod || rule->rule_dev != node_ptr->dev)) continue;
+        this_cpu_inc(rm->filter_stats->filtered);
+        return true;
+    }
+    return false;
+}
+
+void log_aggr_init(struct log_aggr* aggr){
+    hash_init(aggr->index);
+    aggr->nr_entries = 0;
+}
+
+/*counts a denial, called with rm->log_mutex held. Returns true if the denial must be logged
+in full: first occurrence of its key, or no memory to track it. Only then the program is hashed
+into log_info->file_content_hash, a denial whose program can't be hashed is dropped*/
+bool log_aggr_account(struct log_aggr* aggr, struct log_info* log_info){
+    struct aggr_entry* entry;
+    struct inode* exe_inode = file_inode(log_info->fp_executable);
+    uid_t euid = from_kuid(&init_user_ns, log_info->effect_uid);
+    size_t rule_len = strlen(log_info->pathname), digest_len;
+    u32 hash;
+
+    hash = jhash(log_info->pathname, rule_len, jhash_2words(log_info->op, euid, 0));
+    hash = jhash_3words(exe_inode->i_sb->s_dev, (u32)exe_inode->i_ino, exe_inode->i_generation, hash);
+    hash_for_each_possible(aggr->index, entry, hnode, hash){
+        if(entry->hash == hash && entry->op == log_info->op && entry->euid == euid &&
+                entry->exe_dev == exe_inode->i_sb->s_dev && entry->exe_ino == exe_inode->i_ino &&
+                entry->exe_generation == exe_inode->i_generation && !strcmp(entry->strs, log_info->pathname)){
+            entry->pending++;
+            entry->total++;
+            return false;
+        }
+    }
+    log_info->file_content_hash = file_content_fingerprint(log_info->fp_executable);
+    if(!log_info->file_content_hash) return false;
+    if(aggr->nr_entries == AGGR_MAX)
+        log_aggr_flush(rm, true);
+
+    digest_len = strlen(log_info->file_content_hash);
+    entry = kmalloc(sizeof(struct aggr_entry) + rule_len + digest_len + 2, GFP_KERNEL);
+    if(!entry) return true;
+    entry->hash = hash;
+    entry->op = log_info->op;
+    entry->euid = euid;
+    entry->exe_dev = exe_inode->i_sb->s_dev;
+    entry->exe_ino = exe_inode->i_ino;
+    entry->exe_generation = exe_inode->i_generation;
+    entry->pending = 0;
+    entry->total = 1;
+    memcpy(entry->strs, log_info->pathname, rule_len + 1);
+    entry->digest = entry->strs + rule_len + 1;
+    memcpy(entry->digest, log_info->file_content_hash, digest_len + 1);
+    hash_add(aggr->index, &entry->hnode, hash);
+    aggr->nr_entries++;
+    return true;
+}
+
+/*writes a summary line for every key denied since the previous flush, called with rm->log_mutex held.
+With clear the keys are forgotten (their next denial is logged in full again)*/
+void log_aggr_flush(ref_mon* rm, bool clear){
+    struct aggr_entry* entry;
+    struct hlist_node* tmp;
+    int bkt, len = 0, ret;
+
+    hash_for_each_safe(rm->log_aggr.index, bkt, tmp, entry, hnode){
+        if(entry->pending){
+            if(len > LOG_BUF_SIZE - PAGE_SIZE - 256){
+                ret = kernel_write(rm->log_file, rm->log_buf, len, &rm->log_file->f_pos);
+                if(ret != len)
+                    printk(KERN_ERR "%s: Failed to write into the log file!!: bytes written are %d\n", MODNAME, ret);
+                len = 0;
+            }
+            len += scnprintf(rm->log_buf + len, LOG_BUF_SIZE - len, "summary: pathname: %s, operation: %s, effective uid: %u, file content hash: %s, denials: %lu, total: %lu\n",
+                    entry->strs, rm_op_name[entry->op], entry->euid, entry->digest, entry->pending, entry->total);
+            entry->pending = 0;
+        }
+        if(clear){
+            hash_del(&entry->hnode);
+            kfree(entry);
+        }
+    }
+    if(clear)
+        rm->log_aggr.nr_entries = 0;
+    if(len){
+        ret = kernel_write(rm->log_file, rm->log_buf, len, &rm->log_file->f_pos);
+        if(ret != len)
+            printk(KERN_ERR "%s: Failed to write into the log file!!: bytes written are %d\n", MODNAME, ret);
+    }
+}
+
+void log_dict_init(struct log_dict* dict){
+    hash_init(dict->index);
+    dict->nr_entries = 0;
+}
+
+//forgets every string and writes the reset record into buf, returns its length
+int log_dict_reset(struct log_dict* dict, char* buf, size_t size){
+    struct dict_entry* entry;
+    struct hlist_node* tmp;
+    int bkt;
+
+    hash_for_each_safe(dict->index, bkt, tmp, entry, hnode){
+        hash_del(&entry->hnode);
+        kfree(entry);
+    }
+    dict->nr_entries = 0;
+    return scnprintf(buf, size, "R %d\n", LOG_DICT_VERSION);
+}
+
+/*id of str, a definition record is appended at buf + *len the first time str is seen.
+Returns a negative value if the string can't be defined*/
+static int log_dict_id(struct log_dict* dict, char kind, const char* str, char* buf, size_t size, int* len){
+    struct dict_entry* entry;
+    size_t str_len = strlen(str);
+    u32 hash = jhash(str, str_len, kind);
+
+    hash_for_each_possible(dict->index, entry, hnode, hash)
+        if(entry->hash == hash && entry->kind == kind && !strcmp(entry->str, str))
+            return entry->id;
+
+    entry = kmalloc(sizeof(struct dict_entry) + str_len + 1, GFP_KERNEL);
+    if(!entry) return -ENOMEM;
+    entry->hash = hash;
+    entry->kind = kind;
+    entry->id = dict->nr_entries++;
+    memcpy(entry->str, str, str_len + 1);
+    hash_add(dict->index, &entry->hnode, hash);
+    *len += scnprintf(buf + *len, size - *len, "D %u %c %s\n", entry->id, kind, str);
+    return entry->id;
+}
+
+/*formats the record of a denied operation according to rm->log_mode, called with rm->log_mutex held.
+Returns the number of bytes to write*/
+int format_log_record(ref_mon* rm, struct log_info* log_info, const char* program, char* buf, size_t size){
+    int len = 0, rule_id, program_id, digest_id;
+
+    if(rm->log_mode == LOG_MODE_DICT){
+        if(rm->log_dict.nr_entries + 3 > LOG_DICT_MAX) //the ids of a record belong to the same dictionary
+            len = log_dict_reset(&rm->log_dict, buf, size);
+        rule_id = log_dict_id(&rm->log_dict, 'r', log_info->pathname, buf, size, &len);
+        program_id = log_dict_id(&rm->log_dict, 'p', program, buf, size, &len);
+        digest_id = log_dict_id(&rm->log_dict, 'h', log_info->file_content_hash, buf, size, &len);
+        if(rule_id >= 0 && program_id >= 0 && digest_id >= 0)
+            return len + scnprintf(buf + len, size - len, "E %d %d %d %d %d %d %d %d\n", rule_id, log_info->op, program_id, digest_id,
+                    log_info->tgid, log_info->tid, from_kuid(&init_user_ns, log_info->effect_uid), from_kuid(&init_user_ns, log_info->real_uid));
+        //out of memory: the definitions already emitted stay valid, the event is written in clear
+    }
+    return len + scnprintf(buf + len, size - len, "pathname: %s, operation: %s, program: %s, file content hash: %s, tgid: %d, tid: %d, effective uid: %d, real uid: %d\n",
+            log_info->pathname, rm_op_name[log_info->op], program, log_info->file_content_hash, log_info->tgid, log_info->tid,
+            from_kuid(&init_user_ns, log_info->effect_uid), from_kuid(&init_user_ns, log_info->real_uid));
+}
+
+int exe_path_cache_init(struct exe_path_cache* cache){
+    mutex_init(&cache->lock);
+    hash_init(cache->index);
+    INIT_LIST_HEAD(&cache->lru);
+    cache->nr_entries = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->scratch = (char*)__get_free_page(GFP_KERNEL);
+    return cache->scratch ? 0 : -ENOMEM;
+}
+
+void exe_path_cache_destroy(struct exe_path_cache* cache){
+    struct exe_path *entry, *tmp;
+
+    list_for_each_entry_safe(entry, tmp, &cache->lru, lru)
+        kfree(entry);
+    INIT_LIST_HEAD(&cache->lru);
+    WRITE_ONCE(cache->nr_entries, 0);
+    free_page((unsigned long)cache->scratch);
+    cache->scratch = NULL;
+}
+
+/*path of the executable file: the string is valid until exe_path_put, which must be called
+in any case. d_path runs only on a miss*/
+const char* exe_path_get(struct exe_path_cache* cache, struct file* file){
+    struct inode* inode = file_inode(file);
+    struct exe_path* entry;
+    u64 key = blk_key(inode->i_sb->s_dev, inode->i_ino);
+    char* path;
+    size_t len;
+
+    mutex_lock(&cache->lock);
+    hash_for_each_possible(cache->index, entry, hnode, key){
+        if(entry->key == key && entry->generation == inode->i_generation){
+            cache->hits++;
+            list_move(&entry->lru, &cache->lru);
+            return entry->path;
+        }
+    }
+    cache->misses++;
+
+    path = d_path(&file->f_path, cache->scratch, PAGE_SIZE);
+    if(IS_ERR(path)) return "unknown";
+    len = strlen(path);
+    if(cache->nr_entries == EXE_CACHE_MAX){
+        entry = list_last_entry(&cache->lru, struct exe_path, lru);
+        hash_del(&entry->hnode);
+        list_del(&entry->lru);
+        kfree(entry);
+        cache->nr_entries--;
+    }
+    entry = kmalloc(sizeof(struct exe_path) + len + 1, GFP_KERNEL);
+    if(!entry) return path; //not cached, the scratch page is valid until exe_path_put
+    entry->key = key;
+    entry->generation = inode->i_generation;
+    memcpy(entry->path, path, len + 1);
+    hash_add(cache->index, &entry->hnode, key);
+    list_add(&entry->lru, &cache->lru);
+    cache->nr_entries++;
+    return entry->path;
+}
+
+void exe_path_put(struct exe_path_cache* cache){
+    mutex_unlock(&cache->lock);
+}
+
+int bloom_init(struct blk_bloom* bloom, unsigned int bits, unsigned int hashes){
+    if(bits < 8 || bits > 24 || hashes < 1 || hashes > BLOOM_MAX_HASHES){
+        printk("%s: invalid prefilter geometry (bits %u, hashes %u)\n", MODNAME, bits, hashes);
+        return -EINVAL;
+    }
+    bloom->bits = bits;
+    bloom->hashes = hashes;
+    bloom->nr_keys = 0;
+    bloom->nr_set = 0;
+    bloom->counters = kvzalloc(1UL << bits, GFP_KERNEL);
+    if(!bloom->counters) return -ENOMEM;
+    bloom->stats = alloc_percpu(struct bloom_stats);
+    if(!bloom->stats){
+        kvfree(bloom->counters);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void bloom_destroy(struct blk_bloom* bloom){
+    free_percpu(bloom->stats);
+    kvfree(bloom->counters);
+}
+
+//i-th counter of a key (double hashing)
+static inline unsigned long bloom_slot(struct blk_bloom* bloom, u64 key, unsigned int i){
+    u32 h1 = hash_64(key, 32);
+    u32 h2 = hash_64(~key, 32) | 1;
+
+    return (h1 + i * h2) & ((1UL << bloom->bits) - 1);
+}
+
+//called with rm->lock held
+void bloom_add(struct blk_bloom* bloom, u64 key){
+    unsigned long slot;
+    unsigned int i;
+    u8 c;
+
+    for(i = 0; i < bloom->hashes; i++){
+        slot = bloom_slot(bloom, key, i);
+        c = bloom->counters[slot];
+        if(c == U8_MAX) continue;
+        if(c == 0) bloom->nr_set++;
+        WRITE_ONCE(bloom->counters[slot], c + 1);
+    }
+    bloom->nr_keys++;
+}
+
+//called with rm->lock held, key must have been added before
+void bloom_del(struct blk_bloom* bloom, u64 key){
+    unsigned long slot;
+    unsigned int i;
+    u8 c;
+
+    for(i = 0; i < bloom->hashes; i++){
+        slot = bloom_slot(bloom, key, i);
+        c = bloom->counters[slot];
+        if(c == U8_MAX || c == 0) continue; //saturated counters are sticky
+        if(c == 1) bloom->nr_set--;
+        WRITE_ONCE(bloom->counters[slot], c - 1);
+    }
+    bloom->nr_keys--;
+}
+
+/*false means that key is not in the set, true that it may be. Lockless, a key added concurrently
+may be missed as if the hook had run before the insertion*/
+bool bloom_may_contain(struct blk_bloom* bloom, u64 key){
+    unsigned int i;
+
+    this_cpu_inc(bloom->stats->queries);
+    for(i = 0; i < bloom->hashes; i++){
+        if(!READ_ONCE(bloom->counters[bloom_slot(bloom, key, i)])){
+            this_cpu_inc(bloom->stats->negatives);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*prints geometry and effectiveness of the prefilter. The expected false positive rate is
+(nr_set / size)^hashes, computed in parts per million*/
+void bloom_report(struct blk_bloom* bloom){
+    unsigned long queries = 0, negatives = 0, false_positives = 0;
+    unsigned long size = 1UL << bloom->bits;
+    u64 fill, fpr = 1000000;
+    unsigned int i;
+    int cpu;
+
+    spin_lock(&rm->lock);
+    fill = div64_u64((u64)bloom->nr_set * 1000000, size);
+    for(i = 0; i < bloom->hashes; i++)
+        fpr = div64_u64(fpr * fill, 1000000);
+    printk("%s: prefilter %lu counters (%lu bytes), %u hashes, %lu keys, %llu ppm filled, expected false positive rate %llu ppm\n",
+            MODNAME, size, size, bloom->hashes, bloom->nr_keys, fill, fpr);
+    spin_unlock(&rm->lock);
+
+    for_each_possible_cpu(cpu){
+        struct bloom_stats* st = per_cpu_ptr(bloom->stats, cpu);
+        queries += READ_ONCE(st->queries);
+        negatives += READ_ONCE(st->negatives);
+        false_positives += READ_ONCE(st->false_positives);
+    }
+    printk("%s: prefilter %lu queries, %lu lookups skipped, %lu false positives\n", MODNAME, queries, negatives, false_positives);
+}
+
+void path_arena_init(struct path_arena* arena){
+    spin_lock_init(&arena->lock);
+    INIT_LIST_HEAD(&arena->chunks);
+    arena->current_chunk = NULL;
+    arena->nr_pages = 0;
+    arena->live_bytes = 0;
+}
+
+static struct arena_chunk* path_arena_new_chunk(unsigned int size){
+    struct arena_chunk* chunk;
+    unsigned int order;
+
+    order = get_order(sizeof(struct arena_chunk) + size);
+    chunk = (struct arena_chunk*)__get_free_pages(GFP_KERNEL, order);
+    if(!chunk) return NULL;
+    chunk->order = order;
+    chunk->used = 0;
+    chunk->live = 0;
+    return chunk;
+}
+
+//called with arena->lock held
+static void path_arena_add_chunk(struct path_arena* arena, struct arena_chunk* chunk){
+    list_add(&chunk->list, &arena->chunks);
+    arena->nr_pages += 1UL << chunk->order;
+}
+
+//called with arena->lock held
+static void path_arena_release_chunk(struct path_arena* arena, struct arena_chunk* chunk){
+    list_del(&chunk->list);
+    arena->nr_pages -= 1UL << chunk->order;
+    free_pages((unsigned long)chunk, chunk->order);
+}
+
+/*copies len bytes of str (plus the terminator) into the arena, it may sleep*/
+char* path_arena_strdup(struct path_arena* arena, const char* str, unsigned int len){
+    struct arena_chunk* chunk;
+    struct arena_chunk* spare = NULL;
+    unsigned int size = len + 1;
+    char* dst;
+
+    if(size > PAGE_SIZE - sizeof(struct arena_chunk)){
+        chunk = path_arena_new_chunk(size); //dedicated chunk, never used for other paths
+        if(!chunk) return NULL;
+        spin_lock_bh(&arena->lock);
+        path_arena_add_chunk(arena, chunk);
+        goto copy;
+    }
+
+retry:
+    spin_lock_bh(&arena->lock);
+    chunk = arena->current_chunk;
+    if(!chunk || chunk->used + size > PAGE_SIZE - sizeof(struct arena_chunk)){
+        if(!spare){
+            //the page is allocated outside the lock, then the check is repeated
+            spin_unlock_bh(&arena->lock);
+            spare = path_arena_new_chunk(PAGE_SIZE - sizeof(struct arena_chunk));
+            if(!spare) return NULL;
+            goto retry;
+        }
+        if(chunk && chunk->live == 0)
+            path_arena_release_chunk(arena, chunk);
+        chunk = spare;
+        spare = NULL;
+        path_arena_add_chunk(arena, chunk);
+        arena->current_chunk = chunk;
+    }
+copy:
+    dst = chunk->data + chunk->used;
+    memcpy(dst, str, len);
+    dst[len] = '\0';
+    chunk->used += size;
+    chunk->live += size;
+    arena->live_bytes += size;
+    spin_unlock_bh(&arena->lock);
+    if(spare)
+        free_pages((unsigned long)spare, spare->order);
+    return dst;
+}
+
+void path_arena_free(struct path_arena* arena, char* str, unsigned int len){
+    struct arena_chunk* chunk;
+
+    if(!str) return;
+    chunk = (struct arena_chunk*)((unsigned long)str & PAGE_MASK); //paths always start in the first page of their chunk
+    spin_lock_bh(&arena->lock);
+    chunk->live -= len + 1;
+    arena->live_bytes -= len + 1;
+    if(chunk->live == 0 && chunk != arena->current_chunk)
+        path_arena_release_chunk(arena, chunk);
+    spin_unlock_bh(&arena->lock);
+}
+
+void path_arena_destroy(struct path_arena* arena){
+    struct arena_chunk *chunk, *tmp;
+
+    list_for_each_entry_safe(chunk, tmp, &arena->chunks, list)
+        path_arena_release_chunk(arena, chunk);
+    arena->current_chunk = NULL;
+}
+
 void logging_information(ref_mon* rm, struct log_info* log_info){
     packed_work * pkd_work;
     const struct cred *cred;
     
     if(!log_info->pathname){
+        if(log_info->fp_executable) //NULL when the denial has been filtered
+            fput(log_info->fp_executable);
         return;
     }
 
-    pkd_work = kmalloc(sizeof(pkd_work),GFP_ATOMIC);
+    pkd_work = kmalloc(sizeof(packed_work),GFP_ATOMIC);
+    if(!pkd_work) {
+        printk("%s: memory allocation failed\n", MODNAME);
+        kfree(log_info->pathname);
+        fput(log_info->fp_executable);
+        return;
+    }
     pkd_work->log_info = kmalloc(sizeof(struct log_info), GFP_ATOMIC);
-    if(!pkd_work || !pkd_work->log_info) {
+    if(!pkd_work->log_info) {
         printk("%s: memory allocation failed\n", MODNAME);
+        kfree(log_info->pathname);
+        fput(log_info->fp_executable);
+        kfree(pkd_work);
         return;
     }
     /*Retrieve all necessary information to report it into the log file*/
@@ -185,9 +971,12 @@ void logging_information(ref_mon* rm, struct log_info* log_info){
     pkd_work->log_info->effect_uid = cred->euid;
     pkd_work->log_info->tid = current->pid;
     pkd_work->log_info->tgid = current->tgid;
-    pkd_work->log_info->pathname = kstrdup(log_info->pathname,GFP_ATOMIC);
-    pkd_work->log_info->task = log_info->task;
+    pkd_work->log_info->pathname = log_info->pathname; //already a private copy made by the pre-hook
+    pkd_work->log_info->fp_executable = log_info->fp_executable; //the worker never looks at the task
+    pkd_work->log_info->op = log_info->op;
 
+ 
+    this_cpu_inc(rm->filter_stats->logged);
     //enqueue the work in the Workqueue
     INIT_WORK(&pkd_work->work, deferred_logger_handler); 
     queue_work(rm->queue_work, &pkd_work->work);
@@ -243,29 +1032,21 @@ char *safe_copy_from_user(char* src_buffer, int len){
     return pw_buffer;
 }
 
-struct file* my_get_task_exe_file(struct task_struct *ctx)
+/*counted reference to the executable of current, for the pre-hooks: current->mm can't change
+under the running task, so no task_lock is needed. Called inside an RCU read-side section*/
+struct file* get_current_exe_file_rcu(void)
 {
-    struct file *exe_file = NULL;
-    struct mm_struct *mm;
+    struct mm_struct *mm = current->mm;
+    struct file *exe_file;
 
-    if(unlikely(!ctx))
+    if(unlikely(!mm || (current->flags & PF_KTHREAD)))
         return NULL;
-
-    task_lock(ctx);
-
-    if(!(ctx->flags & PF_KTHREAD))
-    {
-        mm = ctx->mm;
-        if(!mm) return NULL;
-        
-        rcu_read_lock();
-
-        exe_file = rcu_dereference(mm->exe_file);
-
-        rcu_read_unlock();
-    }
-    
-    task_unlock(ctx);
-
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,7,0)
+    exe_file = get_file_rcu(&mm->exe_file);
+#else
+    exe_file = rcu_dereference(mm->exe_file);
+    if(exe_file && !get_file_rcu(exe_file))
+        exe_file = NULL;
+#endif
     return exe_file;
-}
\ No newline at end of file
+}
@@ -12,12 +12,16 @@
 
 #define MODNAME "single-fs"
 
-//this iterate function just returns 3 entries: . and .. and then the name of the unique file of the file system
+//this iterate function returns . and .. and then the name of the unique file of the file system, followed by the streams of a multi-stream image
 static int onefilefs_iterate(struct file *file, struct dir_context* ctx) {
 
+	struct onefilefs_fs_info *fsi = ONEFILEFS_SB(file_inode(file)->i_sb);
+	unsigned int nr_streams = onefilefs_framed(fsi) ? fsi->nr_streams : 0;
+	char name[FILENAME_MAXLEN];
+
     	//printk("%s: we are inside readdir with ctx->pos set to %lld", MODNAME, ctx->pos);
 	
-	if(ctx->pos >= (2 + 1)) return 0;//we cannot return more than . and .. and the unique file entry
+	if(ctx->pos >= (2 + 1 + nr_streams)) return 0;//we cannot return more than . and .. and the unique file and stream entries
 
 	if (ctx->pos == 0){
     		//printk("%s: we are inside readdir with ctx->pos set to %lld", MODNAME, ctx->pos);
@@ -52,6 +56,16 @@ static int onefilefs_iterate(struct file *file, struct dir_context* ctx) {
 	
 	}
 
+	while (ctx->pos < 2 + 1 + nr_streams){
+		snprintf(name, sizeof(name), STREAM_FILE_PREFIX "%u", (unsigned int)(ctx->pos - 3));
+		if(!dir_emit(ctx, name, strlen(name), SINGLEFILEFS_STREAM_INODE_NUMBER + ctx->pos - 3, DT_UNKNOWN)){
+			return 0;
+		}
+		else{
+			ctx->pos++;
+		}
+	}
+
 	return 0;
 
 }
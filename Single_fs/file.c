@@ -10,215 +10,795 @@
 #include <linux/string.h>
 #include <linux/blk_types.h>
 #include <linux/uio.h>
-#include <linux/mutex.h>
+#include <linux/mpage.h>
+#include <linux/blkdev.h>
+#include <linux/pagemap.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/crc32c.h>
+#include <linux/highmem.h>
+#include <linux/uaccess.h>
+#include <linux/splice.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
 #include "singlefilefs.h"
 
 
 #define MODNAME "Single-fs"
 
 #define LOG_FILE_PATH "./mount/the-file"
-static DEFINE_MUTEX(offset_mutex); //*off can be changed concurrently 
 
-ssize_t onefilefs_read(struct file * filp, char __user * buf, size_t len, loff_t * off) {
+/* file block iblock lives in device block slot + data_block (after the descriptor table),
+   the data blocks of a stream are contiguous so the mapping never allocates anything */
+static int onefilefs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create) {
 
-    struct buffer_head *bh = NULL;
-    uint64_t file_size;
-    int ret;
-    loff_t offset;
-    int block_to_read;//index of the block to be read from device
-     
-     if(IS_ERR(filp)){
-        printk("%s: error in input file\n",MOD_NAME);
-        return len;
-     }
-
-     mutex_lock(&offset_mutex);
-     file_size = filp->f_inode->i_size;
-    //check that *off is within boundaries
-    if (*off >= file_size){
-        mutex_unlock(&offset_mutex);
-        return 0;
+    struct super_block *sb = inode->i_sb;
+    struct onefilefs_stream *st = ONEFILEFS_STREAM(inode);
+    sector_t block;
+
+    if (st->segs){
+        //a sealed segment is no longer mapped block by block, onefilefs_read_segment fills its pages
+        if (onefilefs_sealed(st, (loff_t)iblock << sb->s_blocksize_bits))
+            return create ? -EIO : 0;
+    }
+    else if (st->fsi->ring){
+        //a block already overwritten by the ring is no longer mapped, it reads as zeroes
+        if (!create && ((loff_t)iblock << sb->s_blocksize_bits) < smp_load_acquire(&st->head))
+            return 0;
+    }
+    else if (iblock >= st->nr_blocks){
+        if (create)
+            return -ENOSPC; //the device is full
+        return 0; //unmapped, read as zeroes
     }
-    else if (*off + len > file_size)
-        len = file_size - *off;
 
-    //determine the block level offset for the operation
-    offset = *off % DEFAULT_BLOCK_SIZE; 
-    //just read stuff in a single block - residuals will be managed at the applicatin level
-    if (offset + len > DEFAULT_BLOCK_SIZE)
-        len = DEFAULT_BLOCK_SIZE - offset;
+    block = st->fsi->data_block + onefilefs_slot(st, iblock);
 
-    //compute the actual index of the the block to be read from device
-    block_to_read = *off / DEFAULT_BLOCK_SIZE + 2; //the value 2 accounts for superblock and file-inode on device
+    map_bh(bh_result, sb, block);
+    return 0;
+}
 
-    bh = (struct buffer_head *)sb_bread(filp->f_path.dentry->d_inode->i_sb, block_to_read);
-    if(!bh){
-        mutex_unlock(&offset_mutex);
-	    return -EIO;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+static int onefilefs_read_folio(struct file *file, struct folio *folio) {
+    struct onefilefs_stream *st = ONEFILEFS_STREAM(folio->mapping->host);
+
+    if (onefilefs_sealed(st, folio_pos(folio)))
+        return onefilefs_read_segment(st, &folio->page);
+    return block_read_full_folio(folio, onefilefs_get_block);
+}
+#else
+static int onefilefs_readpage(struct file *file, struct page *page) {
+    struct onefilefs_stream *st = ONEFILEFS_STREAM(page->mapping->host);
+
+    if (onefilefs_sealed(st, page_offset(page)))
+        return onefilefs_read_segment(st, page);
+    return block_read_full_page(page, onefilefs_get_block);
+}
+#endif
+
+static void onefilefs_readahead(struct readahead_control *rac) {
+    struct onefilefs_stream *st = ONEFILEFS_STREAM(rac->mapping->host);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+    struct folio *folio;
+
+    //the sealed segments come before the open ones, a window starting in them is read page by page
+    if (onefilefs_sealed(st, readahead_pos(rac))){
+        while ((folio = readahead_folio(rac)))
+            onefilefs_read_folio(NULL, folio);
+        return;
     }
-    ret = copy_to_user(buf,bh->b_data + offset, len);  
-                                                       
-    *off += (len - ret); //incremento di quanti byte effettivamente ho scritto sul file
-    brelse(bh);
-    mutex_unlock(&offset_mutex);
-    
-    
-    return len - ret;
+#else
+    struct page *page;
+
+    if (onefilefs_sealed(st, readahead_pos(rac))){
+        while ((page = readahead_page(rac))){
+            onefilefs_readpage(NULL, page);
+            put_page(page);
+        }
+        return;
+    }
+#endif
+    mpage_readahead(rac, onefilefs_get_block);
+}
 
+static int onefilefs_writepages(struct address_space *mapping, struct writeback_control *wbc) {
+    return mpage_writepages(mapping, wbc, onefilefs_get_block);
 }
 
-ssize_t onefilefs_write_iter(struct kiocb *iocb, struct iov_iter *from) {
-  	struct file *file;
-	struct inode *filp_inode;
-	loff_t blk_offset, size_file;
-    int blk_to_write;
-    struct block_device *bdev; 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+static int onefilefs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, struct folio **foliop, void **fsdata) {
+    return block_write_begin(mapping, pos, len, foliop, onefilefs_get_block);
+}
+#else
+static int onefilefs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, struct page **pagep, void **fsdata) {
+    return block_write_begin(mapping, pos, len, pagep, onefilefs_get_block);
+}
+#endif
+
+/* like generic_write_end but i_size is left alone, onefilefs_write_iter reserves the
+   whole range before copying and publishes the new size once at the end */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+static int onefilefs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned copied, struct folio *folio, void *fsdata) {
+    copied = block_write_end(file, mapping, pos, len, copied, folio, fsdata);
+    folio_unlock(folio);
+    folio_put(folio);
+    return copied;
+}
+#else
+static int onefilefs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned copied, struct page *page, void *fsdata) {
+    copied = block_write_end(file, mapping, pos, len, copied, page, fsdata);
+    unlock_page(page);
+    put_page(page);
+    return copied;
+}
+#endif
+
+static sector_t onefilefs_bmap(struct address_space *mapping, sector_t block) {
+    return generic_block_bmap(mapping, block, onefilefs_get_block);
+}
+
+//the log file goes through the page cache: appends are copies into cached folios written back in background
+const struct address_space_operations onefilefs_aops = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+    .read_folio = onefilefs_read_folio,
+#else
+    .readpage = onefilefs_readpage,
+#endif
+    .readahead = onefilefs_readahead,
+    .writepages = onefilefs_writepages,
+    .write_begin = onefilefs_write_begin,
+    .write_end = onefilefs_write_end,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+    .dirty_folio = block_dirty_folio,
+    .invalidate_folio = block_invalidate_folio,
+#else
+    .set_page_dirty = __set_page_dirty_buffers,
+#endif
+    .bmap = onefilefs_bmap,
+};
+
+/* readers never go past the committed size, the bytes of an append in progress are not visible.
+   In ring mode a read before head continues from head: the stream stays contiguous and
+   ONEFILEFS_IOC_LOG_INFO reports how many bytes were lost. A stream of a multi-stream image
+   is read raw, record headers included */
+static ssize_t onefilefs_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct onefilefs_stream *st = ONEFILEFS_STREAM(file_inode(iocb->ki_filp));
+    loff_t committed = smp_load_acquire(&st->committed);
+    size_t count;
+    ssize_t ret;
+
+    if (st->fsi->ring && iocb->ki_pos < smp_load_acquire(&st->head))
+        iocb->ki_pos = smp_load_acquire(&st->head);
+
+    if (iocb->ki_pos >= committed)
+        return 0;
+    //the caller may go on with the part of the iterator past the committed size
+    count = iov_iter_count(to);
+    iov_iter_truncate(to, committed - iocb->ki_pos);
+    ret = generic_file_read_iter(iocb, to);
+    iov_iter_reexpand(to, count - max_t(ssize_t, ret, 0));
+    return ret;
+}
+
+//reads a stream from pos into the iterator, the merged view goes through here
+ssize_t onefilefs_stream_read(struct file *file, loff_t pos, struct iov_iter *to) {
+    struct kiocb kiocb;
+
+    init_sync_kiocb(&kiocb, file);
+    kiocb.ki_pos = pos;
+    return onefilefs_read_iter(&kiocb, to);
+}
+
+/* sendfile and splice: the pages of the page cache are given to the pipe without copying
+   them, up to the committed size as for read */
+static ssize_t onefilefs_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags) {
+    struct onefilefs_stream *st = ONEFILEFS_STREAM(file_inode(in));
+    loff_t committed = smp_load_acquire(&st->committed);
+
+    if (st->fsi->ring && *ppos < smp_load_acquire(&st->head))
+        *ppos = smp_load_acquire(&st->head);
+
+    if (*ppos >= committed)
+        return 0;
+    len = min_t(loff_t, len, committed - *ppos);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+    return filemap_splice_read(in, ppos, pipe, len, flags);
+#else
+    return generic_file_splice_read(in, ppos, pipe, len, flags);
+#endif
+}
+
+/* tailing readers: the appenders wake commit_wq every time the committed size moves, the
+   file is readable once there are committed bytes past the offset of the reader */
+static __poll_t onefilefs_poll(struct file *file, poll_table *wait) {
+    struct onefilefs_stream *st = ONEFILEFS_STREAM(file_inode(file));
+
+    poll_wait(file, &st->commit_wq, wait);
+    if (smp_load_acquire(&st->committed) > READ_ONCE(file->f_pos))
+        return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+    return EPOLLOUT | EPOLLWRNORM;
+}
+
+/* read-only mappings of the page cache of a stream. The mapping covers i_size, which runs
+   ahead of the committed size while appends are in progress: the bytes past the committed
+   size reported by ONEFILEFS_IOC_LOG_INFO may still change. In ring mode the blocks before
+   head are reused, a page faulted in there would show newer data: no mappings */
+static int onefilefs_mmap(struct file *file, struct vm_area_struct *vma) {
+    if (ONEFILEFS_STREAM(file_inode(file))->fsi->ring)
+        return -ENODEV;
+    return generic_file_readonly_mmap(file, vma);
+}
+
+/* writes the checkpoint of a stream into the superblock and into its FS specific inode,
+   the streams share the superblock block so their checkpoints go one at a time */
+static int onefilefs_checkpoint(struct onefilefs_stream *st, loff_t size, u64 records) {
+    struct onefilefs_fs_info *fsi = st->fsi;
+    struct super_block *sb = fsi->sb;
+    struct onefilefs_sb_info *sb_disk;
+    struct onefilefs_inode *FS_specific_inode;
     struct buffer_head *bh;
-	ssize_t ret;
-    int start = 0;
-    int payload_size; //lunghezza del buffer da scrivere
-    char* buffer_data;
-
-    file = iocb->ki_filp;
-    payload_size = from->count;
-
-    if(IS_ERR(file)){
-        printk("%s: file not open correctly\n",MOD_NAME);
-        return payload_size;
-     }
-
-     if (!iov_iter_count(from)){ //Check if there is data to write
-        printk("%s: no data to write into log file\n", MOD_NAME);
-        return payload_size;
-    }
-    
-    buffer_data = kmalloc(payload_size, GFP_KERNEL);
-    if(!buffer_data) { 
-        printk("%s: memory allocation failed\n", MOD_NAME);
-        return -ENOMEM;
-    }
-    
-    ret = copy_from_iter((void*)buffer_data, (size_t) payload_size, from);
-    if(ret != payload_size){
-        kfree(buffer_data);
-        return ret;
-    }
-    mutex_lock(&offset_mutex);
-    filp_inode = file->f_inode; //retrieve the inode of the file
-    size_file = i_size_read(filp_inode); //determine the size of the file
-    
-    blk_offset = size_file % DEFAULT_BLOCK_SIZE;    //determine the block level offset for the operation
-    blk_to_write = size_file / DEFAULT_BLOCK_SIZE + 2; //determine the block to write, the value 2 accounts for superblock and file-inode on device
-
-    if(payload_size > DEFAULT_BLOCK_SIZE - blk_offset){ //se la dimensione del buffer da scrivere è superiore allo spazio vuoto all'intenro di un blocco
-        bh = (struct buffer_head *)sb_bread(file->f_path.dentry->d_inode->i_sb, blk_to_write);
-        if(!bh){
-            mutex_unlock(&offset_mutex);
-            kfree(buffer_data);
-            return -EIO;
-        }
+    loff_t head = smp_load_acquire(&st->head);
+    int ret;
+
+    mutex_lock(&fsi->sb_mutex);
+    bh = sb_bread(sb, SB_BLOCK_NUMBER);
+    if(!bh){
+        ret = -EIO;
+        goto out;
+    }
+    sb_disk = (struct onefilefs_sb_info *)bh->b_data;
+    sb_disk->stream_checkpoint[st->id] = size;
+    sb_disk->stream_head[st->id] = head;
+    sb_disk->stream_records[st->id] = records;
+    //the fields read by the images of a single stream
+    if (st->id == 0){
+        sb_disk->checkpoint = size;
+        sb_disk->head = head;
+    }
+    sb_disk->free_blocks = onefilefs_free_blocks(fsi);
+    mark_buffer_dirty(bh);
+    ret = sync_dirty_buffer(bh);
+    brelse(bh);
+    if (ret)
+        goto out;
 
-        bdev = bh->b_bdev;  /* device where block resides */
-        if (bdev->bd_read_only){
-            mutex_unlock(&offset_mutex);
-            kfree(buffer_data);
-            return -EPERM;
+    //not needed by the recovery, kept up to date for the tools reading the inode
+    bh = sb_bread(sb, SINGLEFILEFS_INODES_BLOCK_NUMBER);
+    if(!bh){
+        ret = -EIO;
+        goto out;
+    }
+    FS_specific_inode = (struct onefilefs_inode*)bh->b_data + st->id;
+    FS_specific_inode->file_size = size;
+    mark_buffer_dirty(bh);
+    brelse(bh);
+out:
+    mutex_unlock(&fsi->sb_mutex);
+    return ret;
+}
 
+//crc32c of len bytes of the file starting at off, read from the page cache
+static int onefilefs_crc(struct address_space *mapping, loff_t off, size_t len, u32 *crc) {
+    struct page *page;
+    size_t n;
+    void *addr;
+
+    *crc = ~0U;
+    while (len > 0){
+        page = read_mapping_page(mapping, off >> PAGE_SHIFT, NULL);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+        n = min_t(size_t, len, PAGE_SIZE - offset_in_page(off));
+        addr = kmap_local_page(page);
+        *crc = crc32c(*crc, addr + offset_in_page(off), n);
+        kunmap_local(addr);
+        put_page(page);
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* describes the blocks holding [from, size) in the descriptor table. The descriptors are
+   written from the last block to the first one, each table block reaching the device before
+   the previous one is touched: since the file is append-only, a crash in between leaves older
+   descriptors whose crc still matches a prefix of their block, and the recovery stops there.
+   The descriptor holding a boundary also holds the number of records appended up to it */
+static int onefilefs_describe(struct onefilefs_stream *st, struct address_space *mapping, loff_t from, loff_t size, u64 records) {
+    struct onefilefs_fs_info *fsi = st->fsi;
+    struct super_block *sb = fsi->sb;
+    struct onefilefs_block_desc *desc;
+    struct buffer_head *bh = NULL;
+    sector_t b, first, last, slot, table = 0;
+    loff_t start;
+    u32 crc;
+    int ret = 0;
+
+    first = from >> sb->s_blocksize_bits;
+    last = (size - 1) >> sb->s_blocksize_bits;
+
+    for (b = last + 1; b-- > first; ){
+        start = (loff_t)b << sb->s_blocksize_bits;
+        ret = onefilefs_crc(mapping, start, min_t(loff_t, sb->s_blocksize, size - start), &crc);
+        if (ret)
+            break;
+
+        slot = onefilefs_slot(st, b);
+        if (!bh || table != fsi->desc_block + slot / fsi->descs_per_block){
+            if (bh){
+                ret = sync_dirty_buffer(bh);
+                brelse(bh);
+                bh = NULL;
+                if (ret)
+                    break;
+            }
+            table = fsi->desc_block + slot / fsi->descs_per_block;
+            bh = sb_bread(sb, table);
+            if (!bh){
+                ret = -EIO;
+                break;
+            }
         }
 
-        memcpy(bh->b_data + blk_offset, buffer_data,  DEFAULT_BLOCK_SIZE - blk_offset);
-        i_size_write(filp_inode, size_file + DEFAULT_BLOCK_SIZE - blk_offset);
-        payload_size -= DEFAULT_BLOCK_SIZE - blk_offset;
-        start = DEFAULT_BLOCK_SIZE - blk_offset;
+        desc = (struct onefilefs_block_desc *)bh->b_data + slot % fsi->descs_per_block;
+        //the end of the last commit that fell inside the block, the recovery never goes past it
+        if (size <= start + sb->s_blocksize){
+            desc->boundary = size - start;
+            desc->records = records;
+        }
+        else if (desc->seq != b + 1){
+            desc->boundary = 0;
+            desc->records = 0;
+        }
+        desc->seq = b + 1;
+        desc->crc = crc;
+        desc->used = min_t(loff_t, sb->s_blocksize, size - start);
         mark_buffer_dirty(bh);
+    }
+
+    if (bh){
+        if (!ret)
+            ret = sync_dirty_buffer(bh);
         brelse(bh);
-        size_file = i_size_read(filp_inode); 
-        blk_offset = 0;
-        blk_to_write++;
     }
-    
-    bh = (struct buffer_head *)sb_bread(file->f_path.dentry->d_inode->i_sb, blk_to_write);
-    if(!bh){
-        mutex_unlock(&offset_mutex);
-        kfree(buffer_data);
-	    return -EIO;
+    return ret;
+}
+
+/* group commit: makes durable the data committed so far together with its descriptors.
+   Whoever holds commit_mutex flushes for everybody, the appenders and fsync callers queued
+   behind it find their bytes already durable and return without touching the device.
+   The superblock checkpoint, where the recovery starts from, moves every
+   SINGLEFILEFS_CHECKPOINT_BLOCKS blocks or when forced by sync_fs. Every stream commits
+   on its own, only the superblock update is shared */
+int onefilefs_commit(struct onefilefs_stream *st, loff_t target, bool checkpoint) {
+    struct super_block *sb = st->fsi->sb;
+    struct inode *inode;
+    unsigned long sealed;
+    loff_t size, from;
+    u64 records;
+    int ret = 0;
+
+    mutex_lock(&st->commit_mutex);
+    //the record count goes with the committed size it was published with
+    spin_lock(&st->size_lock);
+    size = st->committed;
+    records = st->records;
+    spin_unlock(&st->size_lock);
+
+    if (st->durable < target && size > st->durable){
+        inode = onefilefs_iget(sb, onefilefs_stream_ino(st->fsi, st->id));
+        if (IS_ERR(inode)){
+            ret = PTR_ERR(inode);
+            goto out;
+        }
+        //in ring mode the blocks overwritten since the last commit are not described
+        from = max_t(loff_t, st->durable, smp_load_acquire(&st->head));
+        //data first, a descriptor never covers bytes that are not on the device
+        ret = filemap_write_and_wait_range(inode->i_mapping, from, size - 1);
+        //the index entries of the new intervals as well, the recovery drops those past its end
+        if (!ret)
+            ret = onefilefs_index_flush(st, from, size);
+        if (!ret)
+            ret = onefilefs_describe(st, inode->i_mapping, from, size, records);
+        iput(inode);
+        if (ret)
+            goto out;
+        st->durable = size;
+        st->durable_records = records;
     }
 
-    bdev = bh->b_bdev;  /* device where block resides */
-    if (bdev->bd_read_only){
-        mutex_unlock(&offset_mutex);
-		kfree(buffer_data);
-        return -EPERM;
+    //compressed mode: the full segments just made durable leave the staging area
+    if (st->segs){
+        inode = onefilefs_iget(sb, onefilefs_stream_ino(st->fsi, st->id));
+        if (IS_ERR(inode)){
+            ret = PTR_ERR(inode);
+            goto out;
+        }
+        sealed = st->segs->sealed;
+        ret = onefilefs_seal(st, inode->i_mapping);
+        iput(inode);
+        if (ret)
+            goto out;
+        //the recovery starts past the sealed segments, the checkpoint keeps the record count up to there
+        if (st->segs->sealed != sealed)
+            checkpoint = true;
+    }
 
+    if (st->durable > st->checkpoint &&
+        (checkpoint || st->durable - st->checkpoint >= ((loff_t)SINGLEFILEFS_CHECKPOINT_BLOCKS << sb->s_blocksize_bits))){
+        ret = onefilefs_checkpoint(st, st->durable, st->durable_records);
+        if (!ret)
+            st->checkpoint = st->durable;
     }
-    
-    if(start == 0)
-        memcpy(bh->b_data + blk_offset, buffer_data , payload_size);
-        
-    else
-        memcpy(bh->b_data + blk_offset, buffer_data + start , payload_size);
+out:
+    mutex_unlock(&st->commit_mutex);
+    return ret;
+}
 
-    i_size_write(filp_inode, size_file + payload_size);
-    mark_buffer_dirty(bh);
-    brelse(bh);
-    mutex_unlock(&offset_mutex);
-    kfree(buffer_data);
-	return ret;    
+//commits everything committed so far in every stream, the first error is returned
+int onefilefs_commit_all(struct super_block *sb, bool checkpoint) {
+    struct onefilefs_fs_info *fsi = ONEFILEFS_SB(sb);
+    unsigned int i;
+    int ret = 0, err;
+
+    for (i = 0; i < fsi->nr_streams; i++){
+        err = onefilefs_commit(&fsi->streams[i], smp_load_acquire(&fsi->streams[i].committed), checkpoint);
+        if (err && !ret)
+            ret = err;
+    }
+    return ret;
 }
 
+void onefilefs_commit_work(struct work_struct *work) {
+    struct onefilefs_fs_info *fsi = container_of(to_delayed_work(work), struct onefilefs_fs_info, commit_work);
+    int ret;
 
+    ret = onefilefs_commit_all(fsi->sb, false);
+    if (ret)
+        printk("%s: group commit failed - error %d\n", MOD_NAME, ret);
+}
 
-struct dentry *onefilefs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
+static int onefilefs_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+    struct onefilefs_stream *st = ONEFILEFS_STREAM(file_inode(file));
 
-    struct onefilefs_inode *FS_specific_inode;
-    struct super_block *sb = parent_inode->i_sb;
-    struct buffer_head *bh = NULL;
-    struct inode *the_inode = NULL;
-
-    if(!strcmp(child_dentry->d_name.name, UNIQUE_FILE_NAME)){
-	
-	    //get a locked inode from the cache 
-        the_inode = iget_locked(sb, 1);
-        if (!the_inode)
-       		 return ERR_PTR(-ENOMEM);
-
-	    //already cached inode - simply return successfully
-        if(!(the_inode->i_state & I_NEW)){
-            return child_dentry;
+    //everything committed when fsync is called, the appends still in progress are not waited for
+    return onefilefs_commit(st, smp_load_acquire(&st->committed), false);
+}
+
+/* reserve len bytes at the tail of the log, appenders never wait for each other here.
+   In compressed mode an appender reaching past the staging area seals the oldest open
+   segment before reserving anything */
+static loff_t onefilefs_reserve(struct onefilefs_stream *st, size_t len) {
+    s64 pos = atomic64_read(&st->tail);
+    int ret;
+
+    //in ring mode a record must leave at least one block of the ring to the older data
+    if (st->fsi->ring && len > st->capacity - st->fsi->sb->s_blocksize)
+        return -ENOSPC;
+
+    //a record spans at most two segments, the staging area
+    if (st->segs && len > SINGLEFILEFS_SEGMENT_SIZE)
+        return -EFBIG;
+
+    for (;;){
+        //a record is never split by a full device: either all of it fits or nothing is written
+        if (pos + len > READ_ONCE(st->max_size)){
+            if (!st->segs)
+                return -ENOSPC;
+            ret = onefilefs_make_room(st, pos + len);
+            if (ret)
+                return ret;
+            pos = atomic64_read(&st->tail);
+            continue;
         }
-        //this work is done if the inode was not already cached
-    #if LINUX_VERSION_CODE <= KERNEL_VERSION(5,12,0)
-        inode_init_owner(the_inode, NULL, S_IFREG);
-    #elif LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
-        inode_init_owner(&init_user_ns,the_inode, NULL, S_IFREG);
-    #elif LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
-        inode_init_owner(&nop_mnt_idmap,the_inode, NULL, S_IFREG);
-    #endif
-        
-        the_inode->i_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR | S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH;
-        the_inode->i_fop = &onefilefs_file_operations;
-        the_inode->i_op = &onefilefs_inode_ops;
+        if (atomic64_try_cmpxchg(&st->tail, &pos, pos + len))
+            return pos;
+    }
+}
+
+/* ring mode: before the blocks up to end are written, the ones they overwrite are given up.
+   head only moves over committed bytes (an earlier appender may still be copying below it),
+   their folios are dropped from the page cache, waiting for any writeback in progress, so
+   that no stale folio can reach the device after the new block */
+static void onefilefs_ring_advance(struct inode *inode, struct onefilefs_stream *st, loff_t end) {
+    loff_t head = round_up(end, (loff_t)inode->i_sb->s_blocksize) - st->capacity;
+    loff_t old;
 
-        //just one link for this file
-        set_nlink(the_inode,1);
+    if (head <= smp_load_acquire(&st->head))
+        return;
 
-        //now we retrieve the file size via the FS specific inode, putting it into the generic inode
-        bh = (struct buffer_head *)sb_bread(sb, SINGLEFILEFS_INODES_BLOCK_NUMBER );
-        if(!bh){
-            iput(the_inode); // decrementare il contatore dei riferimenti dell'inode specificato
-            return ERR_PTR(-EIO);
+    wait_event(st->commit_wq, smp_load_acquire(&st->committed) >= head);
+
+    mutex_lock(&st->ring_mutex);
+    old = st->head;
+    if (head > old){
+        smp_store_release(&st->head, head);
+        truncate_inode_pages_range(inode->i_mapping, old, head - 1);
+    }
+    mutex_unlock(&st->ring_mutex);
+}
+
+long onefilefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct onefilefs_fs_info *fsi = ONEFILEFS_SB(file_inode(file)->i_sb);
+    struct onefilefs_stream *st = ONEFILEFS_STREAM(file_inode(file));
+    struct onefilefs_log_info info;
+    struct onefilefs_seek q;
+    unsigned int i;
+    int ret;
+
+    switch (cmd){
+    case ONEFILEFS_IOC_LOG_INFO:
+        memset(&info, 0, sizeof(info));
+        //the merged view reports the sum of the streams
+        for (i = 0; i < fsi->nr_streams; i++){
+            if (st && st != &fsi->streams[i])
+                continue;
+            info.head += smp_load_acquire(&fsi->streams[i].head);
+            info.committed += smp_load_acquire(&fsi->streams[i].committed);
+            info.durable += READ_ONCE(fsi->streams[i].durable);
+            info.capacity += fsi->streams[i].capacity;
         }
-        FS_specific_inode = (struct onefilefs_inode*)bh->b_data;
-        the_inode->i_size = FS_specific_inode->file_size;
-        brelse(bh);
+        info.flags = (fsi->ring ? SINGLEFILEFS_FLAG_RING : 0) | (fsi->compress ? SINGLEFILEFS_FLAG_COMPRESS : 0);
+        if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+            return -EFAULT;
+        return 0;
+    case ONEFILEFS_IOC_SEEK:
+        //the merged view seeks every stream in onefilefs_merged_ioctl
+        if (!st)
+            return -ENOTTY;
+        if (copy_from_user(&q, (void __user *)arg, sizeof(q)))
+            return -EFAULT;
+        ret = onefilefs_index_seek(st, file, &q);
+        if (ret)
+            return ret;
+        if (copy_to_user((void __user *)arg, &q, sizeof(q)))
+            return -EFAULT;
+        return 0;
+    }
+    return -ENOTTY;
+}
+
+//copies the iterator into the page cache of the file at pos
+static ssize_t onefilefs_perform_write(struct kiocb *iocb, loff_t pos, struct iov_iter *from) {
+    iocb->ki_pos = pos;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+    return generic_perform_write(iocb, from);
+#else
+    return generic_perform_write(iocb->ki_filp, from, pos);
+#endif
+}
+
+static ssize_t onefilefs_write_kvec(struct kiocb *iocb, loff_t pos, void *buf, size_t len) {
+    struct kvec kv = { .iov_base = buf, .iov_len = len };
+    struct iov_iter iter;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+    iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, len);
+#else
+    iov_iter_kvec(&iter, WRITE, &kv, 1, len);
+#endif
+    return onefilefs_perform_write(iocb, pos, &iter);
+}
+
+/* a reserved range cannot be given back once later appenders got theirs,
+   what a short copy left unwritten is filled with zeroes */
+static void onefilefs_pad(struct kiocb *iocb, loff_t pos, size_t len) {
+    ssize_t ret;
+
+    while (len > 0){
+        ret = onefilefs_write_kvec(iocb, pos, page_address(ZERO_PAGE(0)), min_t(size_t, len, PAGE_SIZE));
+        if (ret <= 0)
+            break;
+        pos += ret;
+        len -= ret;
+    }
+}
+
+//a filled range whose appender was killed while waiting for the ones before it
+struct onefilefs_pending {
+    struct list_head node;
+    loff_t pos;
+    loff_t end;
+    u64 ts;
+};
+
+/* publishes the range [pos, end), which starts at the committed size, and then the ranges
+   of killed appenders following it. Called with size_lock held */
+static void onefilefs_publish(struct onefilefs_stream *st, loff_t pos, loff_t end, u64 ts) {
+    struct onefilefs_pending *p, *next;
+
+    for (;;){
+        //the sequence number of a record is its rank in the stream, the index takes it with the size
+        onefilefs_index_add(st, st->records++, ts, pos, end);
+        smp_store_release(&st->committed, end);
+        next = NULL;
+        list_for_each_entry(p, &st->pending, node)
+            if (p->pos == end){
+                next = p;
+                break;
+            }
+        if (!next)
+            return;
+        pos = next->pos;
+        end = next->end;
+        ts = next->ts;
+        list_del(&next->node);
+        kfree(next);
+    }
+}
+
+/* appends to a stream. In a multi-stream image every append is a record: the header with
+   its timestamp is reserved together with the payload and written right before it */
+ssize_t onefilefs_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    struct onefilefs_fs_info *fsi = ONEFILEFS_SB(inode->i_sb);
+    struct onefilefs_stream *st = ONEFILEFS_STREAM(inode);
+    struct onefilefs_record rec;
+    struct onefilefs_pending *pend;
+    size_t len = iov_iter_count(from);
+    size_t hdr = onefilefs_framed(fsi) ? sizeof(rec) : 0;
+    size_t copied;
+    ssize_t written;
+    loff_t pos;
+
+    if (!len) //Check if there is data to write
+        return 0;
+
+    if (bdev_read_only(inode->i_sb->s_bdev))
+        return -EPERM;
+
+    if (len > U32_MAX - hdr)
+        return -EFBIG;
+
+    //the file is append-only, whatever the position of the caller
+    pos = onefilefs_reserve(st, hdr + len);
+    if (pos < 0)
+        return pos;
+
+    if (fsi->ring)
+        onefilefs_ring_advance(inode, st, pos + hdr + len);
+
+    /* i_size covers every reserved byte so that writeback never drops a folio filled
+       ahead of the committed size, readers only look at the committed size */
+    spin_lock(&st->size_lock);
+    if (pos + hdr + len > i_size_read(inode))
+        i_size_write(inode, pos + hdr + len);
+    spin_unlock(&st->size_lock);
+
+    rec.ts = ktime_get_real_ns();
+    rec.len = len;
+    rec.magic = SINGLEFILEFS_RECORD_MAGIC;
+
+    //the folios are filled block after block whatever the size of the payload, in parallel with the other appenders
+    if (hdr && onefilefs_write_kvec(iocb, pos, &rec, hdr) != (ssize_t)hdr)
+        written = -EIO;
+    else
+        written = onefilefs_perform_write(iocb, pos + hdr, from);
+    copied = hdr + max_t(ssize_t, written, 0);
+    /* nothing of the payload was appended: the header is written again as the one of a pad
+       record, which the merged view skips. A record whose header can't be written at all is
+       zeroed as a whole, the merged view stops in front of it */
+    if (hdr && written <= 0){
+        rec.magic = SINGLEFILEFS_PAD_MAGIC;
+        if (onefilefs_write_kvec(iocb, pos, &rec, hdr) != (ssize_t)hdr)
+            copied = 0;
+    }
+    if (copied < hdr + len)
+        onefilefs_pad(iocb, pos + copied, hdr + len - copied);
+
+    /* the committed size moves forward in reservation order, every appender publishes its own range.
+       A killed appender can't leave its range unpublished: it is filled (copied or padded), so
+       it is handed to the appender of the range before it */
+    pend = NULL;
+    if (wait_event_killable(st->commit_wq, smp_load_acquire(&st->committed) == pos))
+        pend = kmalloc(sizeof(*pend), GFP_KERNEL | __GFP_NOFAIL);
+    spin_lock(&st->size_lock);
+    if (st->committed == pos)
+        onefilefs_publish(st, pos, pos + hdr + len, rec.ts);
+    else {
+        pend->pos = pos;
+        pend->end = pos + hdr + len;
+        pend->ts = rec.ts;
+        list_add_tail(&pend->node, &st->pending);
+        pend = NULL;
+    }
+    spin_unlock(&st->size_lock);
+    kfree(pend);
+    //pollers wake up here, inotify watchers once the VFS sends FS_MODIFY after we return
+    wake_up_all(&st->commit_wq);
+
+    file_update_time(file);
+    mark_inode_dirty(inode);
+
+    //appends share one flush every commit_interval ms, a no-op while a commit is already scheduled
+    if (commit_interval)
+        queue_delayed_work(system_unbound_wq, &fsi->commit_work, msecs_to_jiffies(commit_interval));
+
+    if (written <= 0)
+        return written ? written : -EFAULT;
+
+    iocb->ki_pos = pos + hdr + written;
+    return generic_write_sync(iocb, written);
+}
+
 
-        d_add(child_dentry, the_inode);
-        dget(child_dentry);
 
-        //unlock the inode to make it usable 
-            unlock_new_inode(the_inode);
+/* returns a referenced inode of the unique file or of a stream. In a multi-stream image
+   the unique file is the merged view, it has no page cache of its own */
+struct inode *onefilefs_iget(struct super_block *sb, unsigned long ino) {
+
+    struct onefilefs_fs_info *fsi = ONEFILEFS_SB(sb);
+    struct onefilefs_stream *st = NULL;
+    struct inode *the_inode;
+
+    if (!onefilefs_framed(fsi))
+        st = &fsi->streams[0];
+    else if (ino != SINGLEFILEFS_FILE_INODE_NUMBER)
+        st = &fsi->streams[ino - SINGLEFILEFS_STREAM_INODE_NUMBER];
+
+    //get a locked inode from the cache 
+    the_inode = iget_locked(sb, ino);
+    if (!the_inode)
+        return ERR_PTR(-ENOMEM);
+
+    //already cached inode - simply return successfully
+    if(!(the_inode->i_state & I_NEW))
+        return the_inode;
+
+    //this work is done if the inode was not already cached
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(5,12,0)
+    inode_init_owner(the_inode, NULL, S_IFREG);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+    inode_init_owner(&init_user_ns,the_inode, NULL, S_IFREG);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    inode_init_owner(&nop_mnt_idmap,the_inode, NULL, S_IFREG);
+#endif
+
+    the_inode->i_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH | S_IWUSR | S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH;
+    the_inode->i_op = &onefilefs_inode_ops;
+    the_inode->i_private = st;
+    if (st){
+        the_inode->i_fop = &onefilefs_file_operations;
+        the_inode->i_mapping->a_ops = &onefilefs_aops;
+        //the file size was recovered at mount time
+        the_inode->i_size = atomic64_read(&st->tail);
+    }
+    else
+        the_inode->i_fop = &onefilefs_merged_operations;
+
+    //just one link for this file
+    set_nlink(the_inode,1);
+
+    //unlock the inode to make it usable 
+    unlock_new_inode(the_inode);
+
+    return the_inode;
+}
+
+struct dentry *onefilefs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
+
+    struct onefilefs_fs_info *fsi = ONEFILEFS_SB(parent_inode->i_sb);
+    struct inode *the_inode;
+    char name[FILENAME_MAXLEN];
+    unsigned long ino = 0;
+    unsigned int i;
+
+    if(!strcmp(child_dentry->d_name.name, UNIQUE_FILE_NAME))
+        ino = SINGLEFILEFS_FILE_INODE_NUMBER;
+
+    for (i = 0; !ino && onefilefs_framed(fsi) && i < fsi->nr_streams; i++){
+        snprintf(name, sizeof(name), STREAM_FILE_PREFIX "%u", i);
+        if(!strcmp(child_dentry->d_name.name, name))
+            ino = SINGLEFILEFS_STREAM_INODE_NUMBER + i;
+    }
 
-        return child_dentry;
+    if (ino){
+        the_inode = onefilefs_iget(parent_inode->i_sb, ino);
+        if (IS_ERR(the_inode))
+            return ERR_CAST(the_inode);
+        return d_splice_alias(the_inode, child_dentry);
     }
 
     return NULL;
@@ -232,6 +812,13 @@ const struct inode_operations onefilefs_inode_ops = {
 
 const struct file_operations onefilefs_file_operations = {
     .owner = THIS_MODULE,
-    .read = onefilefs_read,
+    .llseek = generic_file_llseek,
+    .read_iter = onefilefs_read_iter,
     .write_iter = onefilefs_write_iter, //kernel side
+    .splice_read = onefilefs_splice_read,
+    .mmap = onefilefs_mmap,
+    .poll = onefilefs_poll,
+    .fsync = onefilefs_fsync,
+    .unlocked_ioctl = onefilefs_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
@@ -0,0 +1,207 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/version.h>
+#include <linux/buffer_head.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/uio.h>
+#include <asm/div64.h>
+#include "singlefilefs.h"
+
+/* sparse index of a stream. The appender publishing the record that holds the first byte of
+   an interval fills its entry: the records are published in reservation order, so sequence
+   numbers and offsets grow together. The group commit writes the entries of the committed
+   intervals into the index region before the descriptors, the recovery drops the entries
+   past the recovered size */
+
+#define INDEX_ENTRIES_PER_BLOCK(sb) ((sb)->s_blocksize / sizeof(struct onefilefs_index_entry))
+
+//entry of interval i, relative to the first entry of the stream
+static unsigned long onefilefs_index_slot(struct onefilefs_stream *st, u64 i) {
+    return do_div(i, st->index_entries);
+}
+
+//loads the entries of the stream, called once its size was recovered
+int onefilefs_index_init(struct onefilefs_stream *st) {
+    struct onefilefs_fs_info *fsi = st->fsi;
+    struct super_block *sb = fsi->sb;
+    struct onefilefs_index_entry *e;
+    struct buffer_head *bh;
+    unsigned long i, n, slot;
+
+    //images older than version 5 have no index region
+    st->index_entries = (fsi->data_block - fsi->index_block) * INDEX_ENTRIES_PER_BLOCK(sb) / fsi->nr_streams;
+    if (!st->index_entries)
+        return 0;
+    st->index_first = st->id * st->index_entries;
+
+    st->index = kvcalloc(st->index_entries, sizeof(*st->index), GFP_KERNEL);
+    if (!st->index)
+        return -ENOMEM;
+
+    for (i = 0; i < st->index_entries; i += n){
+        slot = st->index_first + i;
+        bh = sb_bread(sb, fsi->index_block + slot / INDEX_ENTRIES_PER_BLOCK(sb));
+        if (!bh)
+            return -EIO;
+        n = min_t(unsigned long, INDEX_ENTRIES_PER_BLOCK(sb) - slot % INDEX_ENTRIES_PER_BLOCK(sb), st->index_entries - i);
+        memcpy(st->index + i, (struct onefilefs_index_entry *)bh->b_data + slot % INDEX_ENTRIES_PER_BLOCK(sb), n * sizeof(*st->index));
+        brelse(bh);
+    }
+
+    //the records past the recovered size were lost, new ones will take their intervals
+    for (i = 0; i < st->index_entries; i++){
+        e = &st->index[i];
+        if (e->interval && ((loff_t)(e->interval - 1) << SINGLEFILEFS_INDEX_SHIFT) >= st->committed)
+            memset(e, 0, sizeof(*e));
+    }
+    return 0;
+}
+
+void onefilefs_index_free(struct onefilefs_stream *st) {
+    kvfree(st->index);
+    st->index = NULL;
+}
+
+//the record seq appended at [pos, end) holds the first byte of the intervals starting there, under size_lock
+void onefilefs_index_add(struct onefilefs_stream *st, u64 seq, u64 ts, loff_t pos, loff_t end) {
+    struct onefilefs_index_entry *e;
+    u64 i;
+
+    if (!st->index)
+        return;
+
+    for (i = (pos + SINGLEFILEFS_INDEX_SIZE - 1) >> SINGLEFILEFS_INDEX_SHIFT; ((loff_t)i << SINGLEFILEFS_INDEX_SHIFT) < end; i++){
+        e = &st->index[onefilefs_index_slot(st, i)];
+        e->interval = i + 1;
+        e->seq = seq;
+        e->ts = ts;
+        e->off = pos;
+    }
+}
+
+//writes the entries of the intervals starting in [from, size) into the index region
+int onefilefs_index_flush(struct onefilefs_stream *st, loff_t from, loff_t size) {
+    struct onefilefs_fs_info *fsi = st->fsi;
+    struct super_block *sb = fsi->sb;
+    struct buffer_head *bh = NULL;
+    sector_t block, cur = 0;
+    unsigned long slot;
+    u64 i;
+    int ret = 0;
+
+    if (!st->index)
+        return 0;
+
+    for (i = (from + SINGLEFILEFS_INDEX_SIZE - 1) >> SINGLEFILEFS_INDEX_SHIFT; ((loff_t)i << SINGLEFILEFS_INDEX_SHIFT) < size; i++){
+        slot = st->index_first + onefilefs_index_slot(st, i);
+        block = fsi->index_block + slot / INDEX_ENTRIES_PER_BLOCK(sb);
+        if (!bh || block != cur){
+            if (bh){
+                ret = sync_dirty_buffer(bh);
+                brelse(bh);
+                bh = NULL;
+                if (ret)
+                    break;
+            }
+            cur = block;
+            bh = sb_bread(sb, block);
+            if (!bh){
+                ret = -EIO;
+                break;
+            }
+        }
+        //a committed interval is never written again until the entries go around
+        ((struct onefilefs_index_entry *)bh->b_data)[slot % INDEX_ENTRIES_PER_BLOCK(sb)] = st->index[slot - st->index_first];
+        mark_buffer_dirty(bh);
+    }
+
+    if (bh){
+        if (!ret)
+            ret = sync_dirty_buffer(bh);
+        brelse(bh);
+    }
+    return ret;
+}
+
+//true if the record of interval i comes before the ones looked for, an unknown entry does
+static bool onefilefs_index_before(struct onefilefs_index_entry *e, u64 i, struct onefilefs_seek *q) {
+    if (e->interval != i + 1)
+        return true;
+    return q->flags == SINGLEFILEFS_SEEK_TS ? e->ts < q->key : e->seq <= q->key;
+}
+
+//reads the header of the record at off of a multi-stream image
+static bool onefilefs_index_record(struct file *file, loff_t off, struct onefilefs_record *rec) {
+    struct kvec kv = { .iov_base = rec, .iov_len = sizeof(*rec) };
+    struct iov_iter iter;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+    iov_iter_kvec(&iter, ITER_DEST, &kv, 1, kv.iov_len);
+#else
+    iov_iter_kvec(&iter, READ, &kv, 1, kv.iov_len);
+#endif
+    if (onefilefs_stream_read(file, off, &iter) != (ssize_t)sizeof(*rec))
+        return false;
+    //a pad record takes its place in the stream and in the sequence numbers
+    return rec->magic == SINGLEFILEFS_RECORD_MAGIC || rec->magic == SINGLEFILEFS_PAD_MAGIC;
+}
+
+/* ONEFILEFS_IOC_SEEK on a stream: a binary search over the intervals still indexed finds the
+   last record before key, reading from its offset reaches the records looked for within an
+   interval. The records of a multi-stream image carry their timestamp, their headers are
+   followed from there up to the first record matching key */
+int onefilefs_index_seek(struct onefilefs_stream *st, struct file *file, struct onefilefs_seek *q) {
+    struct onefilefs_index_entry e = {0};
+    struct onefilefs_record rec;
+    u64 lo, hi, mid, first;
+    loff_t committed;
+
+    if (!st->index)
+        return -EOPNOTSUPP;
+    if (q->flags != SINGLEFILEFS_SEEK_TS && q->flags != SINGLEFILEFS_SEEK_SEQ)
+        return -EINVAL;
+
+    spin_lock(&st->size_lock);
+    committed = st->committed;
+    hi = committed ? ((committed - 1) >> SINGLEFILEFS_INDEX_SHIFT) + 1 : 0;
+    //the older intervals gave their entries to the newer ones
+    first = lo = hi > st->index_entries ? hi - st->index_entries : 0;
+    while (lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if (onefilefs_index_before(&st->index[onefilefs_index_slot(st, mid)], mid, q))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > first)
+        e = st->index[onefilefs_index_slot(st, lo - 1)];
+    spin_unlock(&st->size_lock);
+
+    //no record indexed before key, or a record overwritten in ring mode: from the oldest byte still readable
+    if (e.interval && e.off >= smp_load_acquire(&st->head)){
+        q->off = e.off;
+        q->seq = e.seq;
+        q->ts = e.ts;
+    }
+    else {
+        q->off = smp_load_acquire(&st->head);
+        q->seq = 0;
+        q->ts = 0;
+    }
+
+    if (!onefilefs_framed(st->fsi))
+        return 0;
+
+    while (q->off + sizeof(rec) <= committed && onefilefs_index_record(file, q->off, &rec)){
+        q->ts = rec.ts;
+        if (q->flags == SINGLEFILEFS_SEEK_TS ? rec.ts >= q->key : q->seq >= q->key)
+            break;
+        q->off += sizeof(rec) + rec.len;
+        q->seq++;
+    }
+    return 0;
+}
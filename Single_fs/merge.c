@@ -0,0 +1,311 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/version.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uio.h>
+#include <linux/mutex.h>
+#include <linux/smp.h>
+#include <linux/uaccess.h>
+#include <linux/splice.h>
+#include <linux/poll.h>
+#include <linux/fsnotify.h>
+#include "singlefilefs.h"
+
+/* the unique file of a multi-stream image: appends go to the stream of the cpu of the writer,
+   reads return the payloads of the committed records of every stream ordered by timestamp.
+   Within a stream the records keep their order, a record committed late in a stream can
+   follow younger records of the other streams already returned */
+
+//an open merged view: one file per stream, appends and reads go through them
+struct onefilefs_merge {
+    struct mutex lock;//one read at a time moves the merge
+    loff_t pos;//bytes of payload returned so far
+    int cur;//stream of the record being returned, -1 if none
+    u32 done;//bytes of the current record already returned
+    struct file *streams[SINGLEFILEFS_MAX_STREAMS];
+    loff_t off[SINGLEFILEFS_MAX_STREAMS];//header of the next record of every stream
+    struct onefilefs_record rec[SINGLEFILEFS_MAX_STREAMS];
+    bool loaded[SINGLEFILEFS_MAX_STREAMS];//rec[i] is the header at off[i]
+};
+
+static void onefilefs_merge_put(struct onefilefs_merge *m, unsigned int nr) {
+    unsigned int i;
+
+    for (i = 0; i < nr; i++)
+        if (m->streams[i])
+            fput(m->streams[i]);
+    kfree(m);
+}
+
+static int onefilefs_merged_open(struct inode *inode, struct file *file) {
+    struct onefilefs_fs_info *fsi = ONEFILEFS_SB(inode->i_sb);
+    struct onefilefs_merge *m;
+    struct inode *stream_inode;
+    struct file *f;
+    char name[FILENAME_MAXLEN];
+    unsigned int i;
+
+    m = kzalloc(sizeof(*m), GFP_KERNEL);
+    if (!m)
+        return -ENOMEM;
+    mutex_init(&m->lock);
+    m->cur = -1;
+
+    //the streams are opened with the mode of the merged view, its permissions were already checked
+    for (i = 0; i < fsi->nr_streams; i++){
+        stream_inode = onefilefs_iget(inode->i_sb, SINGLEFILEFS_STREAM_INODE_NUMBER + i);
+        if (IS_ERR(stream_inode)){
+            onefilefs_merge_put(m, fsi->nr_streams);
+            return PTR_ERR(stream_inode);
+        }
+        snprintf(name, sizeof(name), STREAM_FILE_PREFIX "%u", i);
+        f = alloc_file_pseudo(stream_inode, file->f_path.mnt, name, file->f_flags, &onefilefs_file_operations);
+        if (IS_ERR(f)){
+            iput(stream_inode);
+            onefilefs_merge_put(m, fsi->nr_streams);
+            return PTR_ERR(f);
+        }
+        m->streams[i] = f;
+    }
+
+    file->private_data = m;
+    return 0;
+}
+
+static int onefilefs_merged_release(struct inode *inode, struct file *file) {
+    onefilefs_merge_put(file->private_data, ONEFILEFS_SB(inode->i_sb)->nr_streams);
+    return 0;
+}
+
+//the merge starts again from the first record of every stream
+static void onefilefs_merge_reset(struct onefilefs_merge *m) {
+    m->pos = 0;
+    m->cur = -1;
+    m->done = 0;
+    memset(m->off, 0, sizeof(m->off));
+    memset(m->loaded, 0, sizeof(m->loaded));
+}
+
+/* reads the header of the next record of stream i, false if the stream has no committed record
+   left. The pad records of failed appends are skipped */
+static bool onefilefs_merge_load(struct onefilefs_merge *m, unsigned int i) {
+    struct onefilefs_stream *st = ONEFILEFS_STREAM(file_inode(m->streams[i]));
+    struct kvec kv = { .iov_base = &m->rec[i], .iov_len = sizeof(m->rec[i]) };
+    struct iov_iter iter;
+    loff_t committed;
+
+    if (m->loaded[i])
+        return true;
+    committed = smp_load_acquire(&st->committed);
+
+    for (;;){
+        if (m->off[i] + (loff_t)sizeof(m->rec[i]) > committed)
+            return false;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,1,0)
+        iov_iter_kvec(&iter, ITER_DEST, &kv, 1, kv.iov_len);
+#else
+        iov_iter_kvec(&iter, READ, &kv, 1, kv.iov_len);
+#endif
+        if (onefilefs_stream_read(m->streams[i], m->off[i], &iter) != (ssize_t)sizeof(m->rec[i]))
+            return false;
+        if (m->rec[i].magic != SINGLEFILEFS_PAD_MAGIC)
+            break;
+        m->off[i] += sizeof(m->rec[i]) + m->rec[i].len;
+    }
+
+    //a record whose header could not be written, nothing after it can be found
+    if (m->rec[i].magic != SINGLEFILEFS_RECORD_MAGIC){
+        printk_ratelimited("%s: no record at %lld of stream %u\n", MOD_NAME, m->off[i], i);
+        return false;
+    }
+
+    m->loaded[i] = true;
+    return true;
+}
+
+//the stream holding the oldest record not returned yet, ties go to the lower stream
+static int onefilefs_merge_next(struct onefilefs_merge *m, unsigned int nr) {
+    unsigned int i;
+    int next = -1;
+
+    for (i = 0; i < nr; i++)
+        if (onefilefs_merge_load(m, i) && (next < 0 || m->rec[i].ts < m->rec[next].ts))
+            next = i;
+    return next;
+}
+
+//moves the merge forward by up to n bytes of payload, copied into to unless it is NULL
+static ssize_t onefilefs_merge_advance(struct onefilefs_merge *m, unsigned int nr, size_t n, struct iov_iter *to) {
+    ssize_t r, total = 0;
+    size_t chunk, count;
+    int i;
+
+    while (n > 0){
+        if (m->cur < 0){
+            m->cur = onefilefs_merge_next(m, nr);
+            m->done = 0;
+            if (m->cur < 0)
+                break;
+        }
+        i = m->cur;
+
+        chunk = min_t(size_t, n, m->rec[i].len - m->done);
+        if (chunk && to){
+            //the payload is copied straight from the page cache of the stream
+            count = iov_iter_count(to);
+            iov_iter_truncate(to, chunk);
+            r = onefilefs_stream_read(m->streams[i], m->off[i] + sizeof(m->rec[i]) + m->done, to);
+            iov_iter_reexpand(to, count - max_t(ssize_t, r, 0));
+            if (r <= 0)
+                return total ? total : r;
+        }
+        else
+            r = chunk;
+
+        m->done += r;
+        m->pos += r;
+        n -= r;
+        total += r;
+
+        if (m->done == m->rec[i].len){
+            m->off[i] += sizeof(m->rec[i]) + m->rec[i].len;
+            m->loaded[i] = false;
+            m->cur = -1;
+        }
+    }
+    return total;
+}
+
+//the offsets of the merged view count payload bytes, a seek backwards starts the merge again
+static ssize_t onefilefs_merged_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct onefilefs_merge *m = iocb->ki_filp->private_data;
+    unsigned int nr = ONEFILEFS_SB(file_inode(iocb->ki_filp)->i_sb)->nr_streams;
+    ssize_t ret = 0;
+
+    mutex_lock(&m->lock);
+    if (iocb->ki_pos < m->pos)
+        onefilefs_merge_reset(m);
+    if (iocb->ki_pos > m->pos)
+        onefilefs_merge_advance(m, nr, iocb->ki_pos - m->pos, NULL);
+    //nothing to return past the end of the merged records
+    if (iocb->ki_pos == m->pos){
+        ret = onefilefs_merge_advance(m, nr, iov_iter_count(to), to);
+        iocb->ki_pos = m->pos;
+    }
+    mutex_unlock(&m->lock);
+    return ret;
+}
+
+//no lock is shared between the cpus: each one appends to its own stream
+static ssize_t onefilefs_merged_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct onefilefs_merge *m = iocb->ki_filp->private_data;
+    struct onefilefs_fs_info *fsi = ONEFILEFS_SB(file_inode(iocb->ki_filp)->i_sb);
+    struct kiocb kiocb;
+
+    ssize_t ret;
+
+    init_sync_kiocb(&kiocb, m->streams[raw_smp_processor_id() % fsi->nr_streams]);
+    kiocb.ki_flags = iocb->ki_flags;
+    ret = onefilefs_write_iter(&kiocb, from);
+    //the VFS notifies the watchers of the merged view, those of the stream are notified here
+    if (ret > 0)
+        fsnotify_modify(kiocb.ki_filp);
+    return ret;
+}
+
+/* ONEFILEFS_IOC_SEEK on the merged view, by timestamp only: every stream moves to its first
+   record from key on and the merge goes on from there at the current offset, which is
+   returned in off. A read before it starts the merge again from the beginning */
+static long onefilefs_merged_seek(struct file *file, struct onefilefs_seek __user *arg) {
+    struct onefilefs_merge *m = file->private_data;
+    unsigned int i, nr = ONEFILEFS_SB(file_inode(file)->i_sb)->nr_streams;
+    struct onefilefs_seek q, sq;
+    int ret = 0;
+
+    if (copy_from_user(&q, arg, sizeof(q)))
+        return -EFAULT;
+    //the sequence numbers of the streams are unrelated
+    if (q.flags != SINGLEFILEFS_SEEK_TS)
+        return -EINVAL;
+
+    mutex_lock(&m->lock);
+    for (i = 0; i < nr; i++){
+        sq = q;
+        ret = onefilefs_index_seek(ONEFILEFS_STREAM(file_inode(m->streams[i])), m->streams[i], &sq);
+        if (ret)
+            break;
+        m->off[i] = sq.off;
+        m->loaded[i] = false;
+    }
+    if (ret)
+        onefilefs_merge_reset(m);
+    else {
+        m->pos = q.off = READ_ONCE(file->f_pos);
+        m->cur = -1;
+        m->done = 0;
+    }
+    mutex_unlock(&m->lock);
+    if (ret)
+        return ret;
+
+    q.seq = 0;
+    q.ts = q.key;
+    if (copy_to_user(arg, &q, sizeof(q)))
+        return -EFAULT;
+    return 0;
+}
+
+static long onefilefs_merged_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    if (cmd == ONEFILEFS_IOC_SEEK)
+        return onefilefs_merged_seek(file, (struct onefilefs_seek __user *)arg);
+    return onefilefs_ioctl(file, cmd, arg);
+}
+
+/* readable once a read would return something: the merge is inside a record, a stream has a
+   committed record the merge did not return yet (onefilefs_merge_load skips the pad records and
+   stops at a zeroed one), or the reader went back and the merge starts again */
+static __poll_t onefilefs_merged_poll(struct file *file, poll_table *wait) {
+    struct onefilefs_merge *m = file->private_data;
+    unsigned int i, nr = ONEFILEFS_SB(file_inode(file)->i_sb)->nr_streams;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    for (i = 0; i < nr; i++)
+        poll_wait(file, &ONEFILEFS_STREAM(file_inode(m->streams[i]))->commit_wq, wait);
+
+    mutex_lock(&m->lock);
+    if (READ_ONCE(file->f_pos) < m->pos || m->cur >= 0 || onefilefs_merge_next(m, nr) >= 0)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    mutex_unlock(&m->lock);
+    return mask;
+}
+
+//the merged records are not contiguous in any page cache, splice goes through read_iter
+static ssize_t onefilefs_merged_splice_read(struct file *in, loff_t *ppos, struct pipe_inode_info *pipe, size_t len, unsigned int flags) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+    return copy_splice_read(in, ppos, pipe, len, flags);
+#else
+    return generic_file_splice_read(in, ppos, pipe, len, flags);
+#endif
+}
+
+static int onefilefs_merged_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+    return onefilefs_commit_all(file_inode(file)->i_sb, false);
+}
+
+const struct file_operations onefilefs_merged_operations = {
+    .owner = THIS_MODULE,
+    .open = onefilefs_merged_open,
+    .release = onefilefs_merged_release,
+    .llseek = no_seek_end_llseek,
+    .read_iter = onefilefs_merged_read_iter,
+    .write_iter = onefilefs_merged_write_iter, //kernel side
+    .splice_read = onefilefs_merged_splice_read,
+    .poll = onefilefs_merged_poll,
+    .fsync = onefilefs_merged_fsync,
+    .unlocked_ioctl = onefilefs_merged_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
@@ -0,0 +1,282 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/version.h>
+#include <linux/buffer_head.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/crc32c.h>
+#include <linux/lz4.h>
+#include "singlefilefs.h"
+
+/* compressed mode. The appends fill the page cache as in the other layouts, the blocks of
+   the two open segments being mapped onto the staging area. Once a segment is full and
+   durable the group commit compresses it into the packed region, and from then on its
+   pages are filled by decompressing it. The readers of the packed segments share a
+   single decompressed segment, enough for the sequential reads of a log */
+
+#define SEGMENT_BOUND LZ4_COMPRESSBOUND(SINGLEFILEFS_SEGMENT_SIZE)
+
+//reads the descriptor of block slot of the data blocks
+static int onefilefs_read_desc(struct onefilefs_fs_info *fsi, sector_t slot, struct onefilefs_block_desc *desc) {
+    struct buffer_head *bh;
+
+    bh = sb_bread(fsi->sb, fsi->desc_block + slot / fsi->descs_per_block);
+    if (!bh)
+        return -EIO;
+    *desc = ((struct onefilefs_block_desc *)bh->b_data)[slot % fsi->descs_per_block];
+    brelse(bh);
+    return 0;
+}
+
+/* allocates the buffers and rebuilds the index of the sealed segments, following the
+   descriptors of the packed region from its first block. The packed blocks of a segment
+   reach the device before its descriptor, a segment whose descriptor is missing is still
+   in the staging area */
+int onefilefs_segments_init(struct onefilefs_stream *st) {
+    struct onefilefs_fs_info *fsi = st->fsi;
+    struct super_block *sb = fsi->sb;
+    struct onefilefs_segments *segs;
+    struct onefilefs_block_desc desc;
+    sector_t slot = 0, nr;
+    unsigned long s;
+
+    segs = kzalloc(sizeof(*segs), GFP_KERNEL);
+    if (!segs)
+        return -ENOMEM;
+    st->segs = segs;
+
+    segs->seg_shift = SINGLEFILEFS_SEGMENT_SHIFT - sb->s_blocksize_bits;
+    segs->seg_blocks = (sector_t)1 << segs->seg_shift;
+    if (st->nr_blocks <= 2 * segs->seg_blocks){
+        printk("%s: %llu data blocks cannot hold the staging area of a compressed image\n", MOD_NAME, (unsigned long long)st->nr_blocks);
+        return -EINVAL;
+    }
+    segs->first_slot = st->first_slot + 2 * segs->seg_blocks;
+    segs->nr_slots = st->nr_blocks - 2 * segs->seg_blocks;
+    segs->cached = ULONG_MAX;
+    mutex_init(&segs->read_mutex);
+
+    //a segment takes at least one block
+    segs->index = kvcalloc(segs->nr_slots, sizeof(*segs->index), GFP_KERNEL);
+    segs->src = kvmalloc(SINGLEFILEFS_SEGMENT_SIZE, GFP_KERNEL);
+    segs->dst = kvmalloc(SEGMENT_BOUND, GFP_KERNEL);
+    segs->wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+    segs->plain = kvmalloc(SINGLEFILEFS_SEGMENT_SIZE, GFP_KERNEL);
+    segs->packed = kvmalloc(SEGMENT_BOUND, GFP_KERNEL);
+    if (!segs->index || !segs->src || !segs->dst || !segs->wrkmem || !segs->plain || !segs->packed)
+        return -ENOMEM;
+
+    for (s = 0; slot < segs->nr_slots; s++){
+        if (onefilefs_read_desc(fsi, segs->first_slot + slot, &desc))
+            return -EIO;
+        if (desc.seq != s + 1 || !desc.used || desc.used > SEGMENT_BOUND || desc.boundary != SINGLEFILEFS_SEGMENT_SIZE)
+            break;
+        nr = DIV_ROUND_UP(desc.used, sb->s_blocksize);
+        if (slot + nr > segs->nr_slots)
+            break;
+        segs->index[s].slot = segs->first_slot + slot;
+        segs->index[s].len = desc.used;
+        segs->index[s].crc = desc.crc;
+        slot += nr;
+    }
+    segs->sealed = s;
+    segs->next_slot = slot;
+
+    //an appender never goes past the staging area
+    st->max_size = ((loff_t)segs->sealed + 2) << SINGLEFILEFS_SEGMENT_SHIFT;
+    printk("%s: %lu compressed segments in %llu blocks\n", MOD_NAME, s, (unsigned long long)slot);
+    return 0;
+}
+
+void onefilefs_segments_free(struct onefilefs_stream *st) {
+    struct onefilefs_segments *segs = st->segs;
+
+    if (!segs)
+        return;
+    kvfree(segs->index);
+    kvfree(segs->src);
+    kvfree(segs->dst);
+    kvfree(segs->wrkmem);
+    kvfree(segs->plain);
+    kvfree(segs->packed);
+    kfree(segs);
+    st->segs = NULL;
+}
+
+//copies a segment of the file from the page cache
+static int onefilefs_segment_gather(struct address_space *mapping, loff_t off, char *buf) {
+    struct page *page;
+    size_t done;
+    void *addr;
+
+    for (done = 0; done < SINGLEFILEFS_SEGMENT_SIZE; done += PAGE_SIZE){
+        page = read_mapping_page(mapping, (off + done) >> PAGE_SHIFT, NULL);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+        addr = kmap_local_page(page);
+        memcpy(buf + done, addr, PAGE_SIZE);
+        kunmap_local(addr);
+        put_page(page);
+    }
+    return 0;
+}
+
+//writes len bytes into a device block and waits for them
+static int onefilefs_segment_write(struct super_block *sb, sector_t block, const char *data, size_t len) {
+    struct buffer_head *bh;
+    int ret;
+
+    bh = sb_getblk(sb, block);
+    if (!bh)
+        return -ENOMEM;
+    lock_buffer(bh);
+    memcpy(bh->b_data, data, len);
+    memset(bh->b_data + len, 0, sb->s_blocksize - len);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    ret = sync_dirty_buffer(bh);
+    brelse(bh);
+    return ret;
+}
+
+static int onefilefs_segment_describe(struct onefilefs_fs_info *fsi, unsigned long s, struct onefilefs_segment *seg) {
+    struct onefilefs_block_desc *desc;
+    struct buffer_head *bh;
+    int ret;
+
+    bh = sb_bread(fsi->sb, fsi->desc_block + seg->slot / fsi->descs_per_block);
+    if (!bh)
+        return -EIO;
+    desc = (struct onefilefs_block_desc *)bh->b_data + seg->slot % fsi->descs_per_block;
+    desc->seq = s + 1;
+    desc->crc = seg->crc;
+    desc->used = seg->len;
+    desc->boundary = SINGLEFILEFS_SEGMENT_SIZE;
+    mark_buffer_dirty(bh);
+    ret = sync_dirty_buffer(bh);
+    brelse(bh);
+    return ret;
+}
+
+/* compresses the full segments already durable in the staging area. Only once the packed
+   blocks and the descriptor are on the device the staging half of the segment is given to
+   the appenders again. Once the packed region is full nothing is sealed any more and the
+   log stops growing. Called under commit_mutex */
+int onefilefs_seal(struct onefilefs_stream *st, struct address_space *mapping) {
+    struct onefilefs_segments *segs = st->segs;
+    struct super_block *sb = st->fsi->sb;
+    struct onefilefs_segment seg;
+    unsigned long s;
+    sector_t nr, i;
+    size_t n;
+    int len, ret;
+
+    while (!segs->full && (((loff_t)segs->sealed + 1) << SINGLEFILEFS_SEGMENT_SHIFT) <= st->durable){
+        s = segs->sealed;
+        ret = onefilefs_segment_gather(mapping, (loff_t)s << SINGLEFILEFS_SEGMENT_SHIFT, segs->src);
+        if (ret)
+            return ret;
+
+        len = LZ4_compress_default(segs->src, segs->dst, SINGLEFILEFS_SEGMENT_SIZE, SEGMENT_BOUND, segs->wrkmem);
+        if (len <= 0)
+            return -EIO;
+
+        nr = DIV_ROUND_UP(len, sb->s_blocksize);
+        if (segs->next_slot + nr > segs->nr_slots){
+            segs->full = true;
+            printk("%s: compressed log full after %lu segments\n", MOD_NAME, s);
+            return 0;
+        }
+
+        seg.slot = segs->first_slot + segs->next_slot;
+        seg.len = len;
+        seg.crc = crc32c(~0U, segs->dst, len);
+        for (i = 0; i < nr; i++){
+            n = min_t(size_t, sb->s_blocksize, len - (i << sb->s_blocksize_bits));
+            ret = onefilefs_segment_write(sb, st->fsi->data_block + seg.slot + i, segs->dst + (i << sb->s_blocksize_bits), n);
+            if (ret)
+                return ret;
+        }
+        ret = onefilefs_segment_describe(st->fsi, s, &seg);
+        if (ret)
+            return ret;
+
+        segs->index[s] = seg;
+        WRITE_ONCE(segs->next_slot, segs->next_slot + nr);
+        smp_store_release(&segs->sealed, s + 1);
+        WRITE_ONCE(st->max_size, ((loff_t)s + 3) << SINGLEFILEFS_SEGMENT_SHIFT);
+    }
+    return 0;
+}
+
+/* an append ending at end needs every segment before the one preceding its last one to be
+   sealed. The bytes reserved before it fill those segments, their appenders never wait for
+   a seal: once they are committed a group commit seals them */
+int onefilefs_make_room(struct onefilefs_stream *st, loff_t end) {
+    unsigned long need = ((end - 1) >> SINGLEFILEFS_SEGMENT_SHIFT) - 1;
+    loff_t sealed_end = (loff_t)need << SINGLEFILEFS_SEGMENT_SHIFT;
+    int ret;
+
+    wait_event(st->commit_wq, smp_load_acquire(&st->committed) >= sealed_end);
+    ret = onefilefs_commit(st, sealed_end, false);
+    if (ret)
+        return ret;
+    return smp_load_acquire(&st->segs->sealed) < need ? -ENOSPC : 0;
+}
+
+//decompresses segment s into plain, under read_mutex
+static int onefilefs_segment_load(struct onefilefs_stream *st, unsigned long s) {
+    struct onefilefs_segments *segs = st->segs;
+    struct onefilefs_segment *seg = &segs->index[s];
+    struct super_block *sb = st->fsi->sb;
+    struct buffer_head *bh;
+    size_t done, n;
+
+    for (done = 0; done < seg->len; done += n){
+        n = min_t(size_t, sb->s_blocksize, seg->len - done);
+        bh = sb_bread(sb, st->fsi->data_block + seg->slot + (done >> sb->s_blocksize_bits));
+        if (!bh)
+            return -EIO;
+        memcpy(segs->packed + done, bh->b_data, n);
+        brelse(bh);
+    }
+
+    if (crc32c(~0U, segs->packed, seg->len) != seg->crc ||
+        LZ4_decompress_safe(segs->packed, segs->plain, seg->len, SINGLEFILEFS_SEGMENT_SIZE) != SINGLEFILEFS_SEGMENT_SIZE){
+        printk("%s: compressed segment %lu is corrupted\n", MOD_NAME, s);
+        return -EIO;
+    }
+    segs->cached = s;
+    return 0;
+}
+
+//fills and unlocks a page of a sealed segment
+int onefilefs_read_segment(struct onefilefs_stream *st, struct page *page) {
+    struct onefilefs_segments *segs = st->segs;
+    loff_t pos = page_offset(page);
+    unsigned long s = pos >> SINGLEFILEFS_SEGMENT_SHIFT;
+    void *addr;
+    int ret = 0;
+
+    mutex_lock(&segs->read_mutex);
+    if (segs->cached != s)
+        ret = onefilefs_segment_load(st, s);
+    if (!ret){
+        addr = kmap_local_page(page);
+        memcpy(addr, segs->plain + (pos & (SINGLEFILEFS_SEGMENT_SIZE - 1)), PAGE_SIZE);
+        kunmap_local(addr);
+        SetPageUptodate(page);
+    }
+    else
+        segs->cached = ULONG_MAX;
+    mutex_unlock(&segs->read_mutex);
+
+    unlock_page(page);
+    return ret;
+}
@@ -9,6 +9,7 @@
 
 #define MAGIC 0x42424242
 #define DEFAULT_BLOCK_SIZE 4096
+#define SINGLEFILEFS_MIN_BLOCK_SIZE 512 //the superblock is read with this block size before the real one is known
 #define SB_BLOCK_NUMBER 0
 #define DEFAULT_FILE_INODE_BLOCK 1
 
@@ -18,14 +19,27 @@
 #define SINGLEFILEFS_FILE_INODE_NUMBER 1
 
 #define SINGLEFILEFS_INODES_BLOCK_NUMBER 1
+#define SINGLEFILEFS_DESC_BLOCK_NUMBER 2 //first block of the descriptor table, the data blocks follow it
+
+#define SINGLEFILEFS_VERSION 5 //on-disk layout with descriptor table, checkpoint, ring mode, streams and index
+#define SINGLEFILEFS_MIN_VERSION 2 //oldest layout still mounted, a version 2 image is a linear log
+#define SINGLEFILEFS_CHECKPOINT_BLOCKS 64 //data blocks between two superblock checkpoints
 
 #define UNIQUE_FILE_NAME "the-file"
 
+/* multi-stream images: stream k is the file STREAM_FILE_PREFIX "k" (inode
+   SINGLEFILEFS_STREAM_INODE_NUMBER + k) with its own share of the data blocks, and the-file
+   is a merged view of the streams ordered by record timestamp. A write to the-file goes
+   to the stream of the cpu of the writer */
+#define SINGLEFILEFS_MAX_STREAMS 16
+#define SINGLEFILEFS_STREAM_INODE_NUMBER 100
+#define STREAM_FILE_PREFIX "stream-"
+
 //inode definition
 struct onefilefs_inode {
 	mode_t mode;//not exploited
 	uint64_t inode_no;
-	uint64_t data_block_number;//not exploited
+	uint64_t data_block_number;//first data block
 
 	union {
 		uint64_t file_size;
@@ -45,18 +59,253 @@ struct onefilefs_sb_info {
 	uint64_t version;
 	uint64_t magic;
 	uint64_t block_size;
-	uint64_t inodes_count;//not exploited
-	uint64_t free_blocks;//not exploited
+	uint64_t inodes_count;//files of the image, the root is volatile
+	uint64_t free_blocks;//data blocks never written, updated by the checkpoints
+	uint64_t desc_block;//first block of the descriptor table
+	uint64_t desc_blocks;//blocks of the descriptor table
+	uint64_t data_block;//first data block of the unique file
+	uint64_t checkpoint;//file size known to be on the device, the recovery scan starts from here
+	uint64_t flags;//SINGLEFILEFS_FLAG_*
+	uint64_t head;//ring mode: first byte of the file still in the image at the checkpoint
+	uint64_t nr_streams;//0 or 1: a single file, otherwise the data blocks are shared out among the streams
+	uint64_t stream_checkpoint[SINGLEFILEFS_MAX_STREAMS];//checkpoint of every stream, [0] is also in checkpoint
+	uint64_t stream_head[SINGLEFILEFS_MAX_STREAMS];
+	uint64_t index_block;//first block of the sparse index, the data blocks follow it
+	uint64_t index_blocks;
+	uint64_t stream_records[SINGLEFILEFS_MAX_STREAMS];//records of every stream at its checkpoint
+
+	//padding to fit into a single block, the fields fit in SINGLEFILEFS_MIN_BLOCK_SIZE bytes
+	char padding[ (4 * 1024) - ((14 + 3 * SINGLEFILEFS_MAX_STREAMS) * sizeof(uint64_t))];
+};
+
+//header of every record of a multi-stream image, the merged view returns only the payloads
+struct onefilefs_record {
+	uint64_t ts;//ns since the epoch when the record was appended
+	uint32_t len;//bytes of payload following the header
+	uint32_t magic;//SINGLEFILEFS_RECORD_MAGIC, or SINGLEFILEFS_PAD_MAGIC
+};
+
+#define SINGLEFILEFS_RECORD_MAGIC 0x52454331
+//a record whose append failed, its payload is zeroes and the merged view skips it
+#define SINGLEFILEFS_PAD_MAGIC 0x50414431
+
+/* ring mode: file block b is stored in data block b % data blocks, once the image is full the
+   oldest blocks are overwritten. File offsets keep growing, the bytes before head are lost */
+#define SINGLEFILEFS_FLAG_RING 0x1
+
+/* compressed mode: the file is cut into segments of SINGLEFILEFS_SEGMENT_SIZE bytes. The two
+   open segments are written as they are into a staging area of the first data blocks, a full
+   segment is compressed with LZ4 into the packed region following it. The descriptor of the
+   first packed block of segment s has seq s + 1, used set to the compressed size and boundary
+   to SINGLEFILEFS_SEGMENT_SIZE. Linear layout with a single stream only */
+#define SINGLEFILEFS_FLAG_COMPRESS 0x2
+#define SINGLEFILEFS_SEGMENT_SHIFT 16
+#define SINGLEFILEFS_SEGMENT_SIZE (1 << SINGLEFILEFS_SEGMENT_SHIFT)
+
+//returned by the ONEFILEFS_IOC_LOG_INFO ioctl on the unique file (the merged view adds up the streams)
+struct onefilefs_log_info {
+	uint64_t head;//first readable byte, the bytes before it were overwritten in ring mode
+	uint64_t committed;//size of the file visible to readers
+	uint64_t durable;//size of the file known to be on the device
+	uint64_t capacity;//bytes of the data blocks
+	uint64_t flags;//SINGLEFILEFS_FLAG_*
+};
+
+#define ONEFILEFS_IOC_MAGIC 0x42
+#define ONEFILEFS_IOC_LOG_INFO _IOR(ONEFILEFS_IOC_MAGIC, 1, struct onefilefs_log_info)
+
+/* sparse index: every SINGLEFILEFS_INDEX_SIZE bytes of a file the record holding the first
+   byte of the interval is recorded, the entries of a stream are used as a ring */
+#define SINGLEFILEFS_INDEX_SHIFT 16
+#define SINGLEFILEFS_INDEX_SIZE (1 << SINGLEFILEFS_INDEX_SHIFT)
+
+struct onefilefs_index_entry {
+	uint64_t interval;//interval number + 1, 0 for an unused entry
+	uint64_t seq;//sequence number of the record, the appends to the file counted from 0
+	uint64_t ts;//ns since the epoch when the record was appended
+	uint64_t off;//offset of the record in the file
+};
+
+//ONEFILEFS_IOC_SEEK: finds where to start reading for the records from a time or a sequence number on
+struct onefilefs_seek {
+	uint64_t flags;//in: SINGLEFILEFS_SEEK_*
+	uint64_t key;//in: ns since the epoch or sequence number
+	uint64_t off;//out: offset of a record at or before the first one matching key
+	uint64_t seq;//out: sequence number of the record at off (stream files only)
+	uint64_t ts;//out: timestamp of the record at off, 0 if not known
+};
+
+#define SINGLEFILEFS_SEEK_TS 0x1
+#define SINGLEFILEFS_SEEK_SEQ 0x2
+
+#define ONEFILEFS_IOC_SEEK _IOWR(ONEFILEFS_IOC_MAGIC, 2, struct onefilefs_seek)
+
+/* descriptor of a data block, the table has one entry per data block. A descriptor is valid
+   if seq is the file block number + 1 and crc matches the first used bytes of the block */
+struct onefilefs_block_desc {
+	uint64_t seq;//0 if the block was never committed
+	uint32_t crc;//crc32c (seed ~0, no final xor) of the first used bytes
+	uint32_t used;//bytes of the block holding data
+	uint32_t boundary;//end of the last commit inside the block, 0 if none
+	uint32_t pad;
+	uint64_t records;//records appended up to the boundary (version 5)
+};
 
-	//padding to fit into a single block
-	char padding[ (4 * 1024) - (5 * sizeof(uint64_t))];
+#ifdef __KERNEL__
+#include <linux/workqueue.h>
+
+struct onefilefs_fs_info;
+
+//where a sealed segment is stored
+struct onefilefs_segment {
+	sector_t slot;//first packed block, relative to data_block
+	u32 len;//compressed bytes
+	u32 crc;//crc32c of the compressed bytes
+};
+
+//compressed mode state of a stream
+struct onefilefs_segments {
+	sector_t seg_blocks;//blocks of a segment
+	unsigned int seg_shift;//log2 of seg_blocks
+	sector_t first_slot;//first block of the packed region, relative to data_block
+	sector_t nr_slots;//blocks of the packed region
+	sector_t next_slot;//first free block of the packed region, relative to first_slot
+	unsigned long sealed;//segments already compressed, moved under commit_mutex
+	bool full;//the packed region has no room for the next segment
+	struct onefilefs_segment *index;//one entry per sealed segment
+	void *src, *dst, *wrkmem;//compression buffers, under commit_mutex
+	struct mutex read_mutex;//protects the decompressed segment kept for the readers
+	unsigned long cached;//segment held in plain, ULONG_MAX if none
+	void *plain, *packed;
+};
+
+//one append-only log: the unique file, or one stream of a multi-stream image
+struct onefilefs_stream {
+	struct onefilefs_fs_info *fsi;
+	unsigned int id;
+	sector_t first_slot;//first data block of the stream, relative to data_block
+	sector_t nr_blocks;//data blocks of the stream
+	loff_t capacity;//bytes of the data blocks
+	loff_t max_size;//largest size of the file
+	loff_t head;//ring mode: first readable byte, moved under ring_mutex, read locklessly
+	struct mutex ring_mutex;
+	atomic64_t tail;//end of the reserved bytes, appenders move it with a cmpxchg
+	loff_t committed;//size of the file visible to readers, it moves in reservation order
+	wait_queue_head_t commit_wq;//appenders waiting for the previous ranges to be committed
+	spinlock_t size_lock;//serializes the i_size updates, held for a compare and a store
+	struct mutex commit_mutex;//one group commit at a time
+	loff_t durable;//size of the file known to be on the device, under commit_mutex
+	loff_t checkpoint;//size of the file recorded in the superblock, under commit_mutex
+	struct onefilefs_segments *segs;//compressed mode, NULL otherwise
+	u64 records;//records in the committed bytes, moved together with committed under size_lock
+	struct list_head pending;//filled ranges of killed appenders, published after the range before them, under size_lock
+	u64 durable_records;//records in the durable bytes, under commit_mutex
+	struct onefilefs_index_entry *index;//in-memory copy of the index entries of the stream, NULL without index
+	unsigned long index_first;//first entry of the stream in the index region
+	unsigned long index_entries;
 };
 
+//in-memory information of a mounted image, kept in sb->s_fs_info
+struct onefilefs_fs_info {
+	sector_t nr_data_blocks;
+	sector_t desc_block;//first block of the descriptor table
+	sector_t data_block;//first data block
+	sector_t index_block;//first block of the sparse index
+	unsigned int descs_per_block;
+	bool ring;//SINGLEFILEFS_FLAG_RING
+	bool compress;//SINGLEFILEFS_FLAG_COMPRESS
+	unsigned int nr_streams;
+	struct onefilefs_stream streams[SINGLEFILEFS_MAX_STREAMS];
+	struct mutex sb_mutex;//serializes the checkpoints of the streams
+	struct delayed_work commit_work;//periodic group commit
+	struct super_block *sb;
+};
+
+static inline struct onefilefs_fs_info *ONEFILEFS_SB(struct super_block *sb) {
+	return sb->s_fs_info;
+}
+
+//the stream of a file, NULL for the merged view of a multi-stream image
+static inline struct onefilefs_stream *ONEFILEFS_STREAM(struct inode *inode) {
+	return inode->i_private;
+}
+
+static inline bool onefilefs_framed(struct onefilefs_fs_info *fsi) {
+	return fsi->nr_streams > 1;
+}
+
+static inline unsigned long onefilefs_stream_ino(struct onefilefs_fs_info *fsi, unsigned int id) {
+	return onefilefs_framed(fsi) ? SINGLEFILEFS_STREAM_INODE_NUMBER + id : SINGLEFILEFS_FILE_INODE_NUMBER;
+}
+
+//data blocks not reserved by any stream
+static inline u64 onefilefs_free_blocks(struct onefilefs_fs_info *fsi) {
+	u64 free = 0;
+	sector_t used;
+	unsigned int i;
+
+	for (i = 0; i < fsi->nr_streams; i++){
+		//compressed mode: what is left of the packed region
+		if (fsi->streams[i].segs){
+			free += fsi->streams[i].segs->nr_slots - READ_ONCE(fsi->streams[i].segs->next_slot);
+			continue;
+		}
+		used = DIV_ROUND_UP_ULL(atomic64_read(&fsi->streams[i].tail), fsi->sb->s_blocksize);
+		if (used < fsi->streams[i].nr_blocks)
+			free += fsi->streams[i].nr_blocks - used;
+	}
+	return free;
+}
+
+//index, relative to data_block, of the data block (and of its descriptor) holding block b of the stream
+static inline sector_t onefilefs_slot(struct onefilefs_stream *st, sector_t b) {
+	//compressed mode: an open segment takes one of the two halves of the staging area
+	if (st->segs)
+		return st->first_slot + (((b >> st->segs->seg_shift) & 1) << st->segs->seg_shift) + (b & (st->segs->seg_blocks - 1));
+	if (st->fsi->ring)
+		return st->first_slot + sector_div(b, st->nr_blocks);
+	return st->first_slot + b;
+}
+
+//true if the byte at pos belongs to a segment already compressed
+static inline bool onefilefs_sealed(struct onefilefs_stream *st, loff_t pos) {
+	return st->segs && pos < ((loff_t)smp_load_acquire(&st->segs->sealed) << SINGLEFILEFS_SEGMENT_SHIFT);
+}
+
 // file.c
 extern const struct inode_operations onefilefs_inode_ops;
 extern const struct file_operations onefilefs_file_operations; 
+extern const struct address_space_operations onefilefs_aops;
+extern struct inode *onefilefs_iget(struct super_block *sb, unsigned long ino);
+extern int onefilefs_commit(struct onefilefs_stream *st, loff_t target, bool checkpoint);
+extern int onefilefs_commit_all(struct super_block *sb, bool checkpoint);
+extern void onefilefs_commit_work(struct work_struct *work);
+extern ssize_t onefilefs_write_iter(struct kiocb *iocb, struct iov_iter *from);
+extern long onefilefs_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+extern ssize_t onefilefs_stream_read(struct file *file, loff_t pos, struct iov_iter *to);
+
+// segment.c
+extern int onefilefs_segments_init(struct onefilefs_stream *st);
+extern void onefilefs_segments_free(struct onefilefs_stream *st);
+extern int onefilefs_seal(struct onefilefs_stream *st, struct address_space *mapping);
+extern int onefilefs_make_room(struct onefilefs_stream *st, loff_t end);
+extern int onefilefs_read_segment(struct onefilefs_stream *st, struct page *page);
+
+// index.c
+extern int onefilefs_index_init(struct onefilefs_stream *st);
+extern void onefilefs_index_free(struct onefilefs_stream *st);
+extern void onefilefs_index_add(struct onefilefs_stream *st, u64 seq, u64 ts, loff_t pos, loff_t end);
+extern int onefilefs_index_flush(struct onefilefs_stream *st, loff_t from, loff_t size);
+extern int onefilefs_index_seek(struct onefilefs_stream *st, struct file *file, struct onefilefs_seek *q);
+
+// merge.c
+extern const struct file_operations onefilefs_merged_operations;
+
+// singlefilefs_src.c
+extern unsigned int commit_interval;
 
 // dir.c
 extern const struct file_operations onefilefs_dir_operations;
+#endif
 
 #endif
@@ -8,17 +8,127 @@
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/version.h>
+#include <linux/blkdev.h>
+#include <linux/crc32c.h>
+#include <linux/statfs.h>
+#include <linux/log2.h>
 
 #include "singlefilefs.h"
 
 
+unsigned int commit_interval = 5000; //ms between two group commits of the log, 0 leaves it to the writeback
+module_param(commit_interval, uint, 0644);
+MODULE_PARM_DESC(commit_interval, "milliseconds between two group commits of the log file, 0 disables them");
+
+static int singlefilefs_sync_fs(struct super_block *sb, int wait) {
+    if (!wait)
+        return 0;
+    return onefilefs_commit_all(sb, true);
+}
+
+//the data blocks never written are free, in ring mode none is once the image went around
+static int singlefilefs_statfs(struct dentry *dentry, struct kstatfs *buf) {
+    struct super_block *sb = dentry->d_sb;
+    struct onefilefs_fs_info *fsi = ONEFILEFS_SB(sb);
+
+    buf->f_type = MAGIC;
+    buf->f_bsize = sb->s_blocksize;
+    buf->f_blocks = fsi->nr_data_blocks;
+    buf->f_bfree = buf->f_bavail = onefilefs_free_blocks(fsi);
+    buf->f_files = fsi->nr_streams;
+    buf->f_ffree = 0;
+    buf->f_namelen = FILENAME_MAXLEN;
+    return 0;
+}
+
 static struct super_operations singlefilefs_super_ops = {
+    .sync_fs = singlefilefs_sync_fs,
+    .statfs = singlefilefs_statfs,
 };
 
 
 static struct dentry_operations singlefilefs_dentry_ops = {
 };
 
+//true if the descriptor of block b of the stream is valid and its crc matches the data block
+static bool singlefilefs_check_block(struct super_block *sb, struct onefilefs_stream *st, sector_t b, struct onefilefs_block_desc *desc) {
+    struct onefilefs_fs_info *fsi = st->fsi;
+    struct buffer_head *bh;
+    sector_t slot = onefilefs_slot(st, b);
+    bool ok;
+
+    bh = sb_bread(sb, fsi->desc_block + slot / fsi->descs_per_block);
+    if (!bh)
+        return false;
+    *desc = ((struct onefilefs_block_desc *)bh->b_data)[slot % fsi->descs_per_block];
+    brelse(bh);
+
+    if (desc->seq != b + 1 || !desc->used || desc->used > sb->s_blocksize || desc->boundary > desc->used)
+        return false;
+
+    bh = sb_bread(sb, fsi->data_block + slot);
+    if (!bh)
+        return false;
+    ok = crc32c(~0U, bh->b_data, desc->used) == desc->crc;
+    brelse(bh);
+    if (!ok)
+        printk("%s: torn block %llu of stream %u discarded\n", MOD_NAME, (unsigned long long)b, st->id);
+    return ok;
+}
+
+/* finds the end of the log after the checkpoint: the descriptors are followed while they
+   describe consecutive blocks whose crc matches, the end of the last commit met on the way
+   is the recovered size. Blocks before the checkpoint are never read, torn or never committed
+   blocks stop the scan and whatever follows the last complete commit is discarded. records
+   goes from the count of the checkpoint to the count of the last commit found */
+static loff_t singlefilefs_recover(struct super_block *sb, struct onefilefs_stream *st, loff_t checkpoint, u64 *records) {
+    struct onefilefs_block_desc desc;
+    sector_t b, end;
+    loff_t size = checkpoint, start;
+
+    //compressed mode: the sealed segments were found by onefilefs_segments_init, the scan goes over the staging area
+    if (st->segs)
+        size = checkpoint = max_t(loff_t, checkpoint, (loff_t)st->segs->sealed << SINGLEFILEFS_SEGMENT_SHIFT);
+
+    b = checkpoint >> sb->s_blocksize_bits;
+    if (st->segs)
+        end = (sector_t)(st->segs->sealed + 2) << st->segs->seg_shift;
+    else //a ring is scanned at most once around
+        end = st->fsi->ring ? b + st->nr_blocks : st->nr_blocks;
+    for (; b < end; b++){
+        if (!singlefilefs_check_block(sb, st, b, &desc))
+            break;
+
+        start = (loff_t)b << sb->s_blocksize_bits;
+        if (desc.boundary && start + desc.boundary > size){
+            size = start + desc.boundary;
+            *records = desc.records;
+        }
+        if (desc.used < sb->s_blocksize)
+            break;
+    }
+
+    if (size > checkpoint)
+        printk("%s: recovered %lld bytes of stream %u after the checkpoint at %lld\n", MOD_NAME, size - checkpoint, st->id, checkpoint);
+    return size;
+}
+
+/* ring mode: the oldest blocks still in the image are the last nr_blocks ones, but blocks
+   written back after the last commit may have overwritten some more of them: the head moves
+   past the blocks whose crc no longer matches */
+static loff_t singlefilefs_ring_head(struct super_block *sb, struct onefilefs_stream *st, loff_t head, loff_t size) {
+    struct onefilefs_block_desc desc;
+    sector_t b;
+
+    head = max_t(loff_t, head, round_up(size, (loff_t)sb->s_blocksize) - st->capacity);
+    head = max_t(loff_t, head, 0);
+    for (b = head >> sb->s_blocksize_bits; ((loff_t)b << sb->s_blocksize_bits) < size; b++){
+        if (singlefilefs_check_block(sb, st, b, &desc))
+            break;
+        head = (loff_t)(b + 1) << sb->s_blocksize_bits;
+    }
+    return min_t(loff_t, head, size);
+}
 
 int singlefilefs_fill_super(struct super_block *sb, void *data, int silent) {   
 
@@ -26,17 +136,47 @@ int singlefilefs_fill_super(struct super_block *sb, void *data, int silent) {
     struct buffer_head *bh;
     struct onefilefs_sb_info *sb_disk;
     struct timespec64 curr_time;
-    uint64_t magic;
+    struct onefilefs_fs_info *fsi;
+    struct onefilefs_stream *st;
+    uint64_t magic, version, block_size, desc_block, data_block, flags, nr_streams;
+    uint64_t checkpoint[SINGLEFILEFS_MAX_STREAMS] = {0}, head[SINGLEFILEFS_MAX_STREAMS] = {0};
+    uint64_t records[SINGLEFILEFS_MAX_STREAMS] = {0}, index_block;
+    unsigned int i;
+    int ret;
 
     //Unique identifier of the filesystem
     sb->s_magic = MAGIC;
 
+    /*the superblock fields fit in the smallest block, the block size of the image is in there.
+    The device may not address blocks that small (4Kn disks): its own block size is used then,
+    block 0 starts at the same byte*/
+    if(!sb_min_blocksize(sb, SINGLEFILEFS_MIN_BLOCK_SIZE)){
+	return -EINVAL;
+    }
+
     bh = sb_bread(sb, SB_BLOCK_NUMBER);
-    if(!sb){
+    if(!bh){
 	return -EIO;
     }
     sb_disk = (struct onefilefs_sb_info *)bh->b_data;
     magic = sb_disk->magic;
+    version = sb_disk->version;
+    block_size = sb_disk->block_size;
+    desc_block = sb_disk->desc_block;
+    data_block = sb_disk->data_block;
+    //the older images have no index region
+    index_block = version >= 5 ? sb_disk->index_block : data_block;
+    flags = version >= 3 ? sb_disk->flags : 0;
+    nr_streams = version >= 4 && sb_disk->nr_streams ? sb_disk->nr_streams : 1;
+    if (version >= 4 && nr_streams <= SINGLEFILEFS_MAX_STREAMS){
+        memcpy(checkpoint, sb_disk->stream_checkpoint, sizeof(checkpoint));
+        memcpy(head, sb_disk->stream_head, sizeof(head));
+    }
+    if (version >= 5 && nr_streams <= SINGLEFILEFS_MAX_STREAMS)
+        memcpy(records, sb_disk->stream_records, sizeof(records));
+    //the first stream is also where the older images keep their unique file
+    checkpoint[0] = sb_disk->checkpoint;
+    head[0] = version >= 3 ? sb_disk->head : 0;
     brelse(bh); // Rilascio del buffer_head dopo l'uso
 
     //check on the expected magic number
@@ -44,7 +184,85 @@ int singlefilefs_fill_super(struct super_block *sb, void *data, int silent) {
 	return -EBADF;
     }
 
-    sb->s_fs_info = NULL; //FS specific data (the magic number) already reported into the generic superblock
+    if(version < SINGLEFILEFS_MIN_VERSION || version > SINGLEFILEFS_VERSION){
+	printk("%s: image version %llu, version %d expected - create it again with singlefilemakefs\n", MOD_NAME, version, SINGLEFILEFS_VERSION);
+	return -EINVAL;
+    }
+
+    /*the page cache maps one file block onto one device block, a block cannot be larger than a page.
+    sb_set_blocksize also refuses a block smaller than the logical block size of the device*/
+    if(block_size < SINGLEFILEFS_MIN_BLOCK_SIZE || block_size > PAGE_SIZE || !is_power_of_2(block_size) || !sb_set_blocksize(sb, block_size)){
+	printk("%s: unsupported block size %llu (device blocks of %u bytes)\n", MOD_NAME, block_size, bdev_logical_block_size(sb->s_bdev));
+	return -EINVAL;
+    }
+
+    fsi = kzalloc(sizeof(*fsi), GFP_KERNEL);
+    if(!fsi){
+	return -ENOMEM;
+    }
+    sb->s_fs_info = fsi; //freed by singlefilefs_kill_superblock, also on a failed mount
+    fsi->sb = sb;
+    mutex_init(&fsi->sb_mutex);
+    INIT_DELAYED_WORK(&fsi->commit_work, onefilefs_commit_work);
+
+    fsi->descs_per_block = block_size / sizeof(struct onefilefs_block_desc);
+    fsi->desc_block = desc_block;
+    fsi->index_block = index_block;
+    fsi->data_block = data_block;
+    //the table follows the superblock and the inode, it must describe every data block, the index sits between the table and the data
+    if(desc_block < SINGLEFILEFS_DESC_BLOCK_NUMBER || index_block <= desc_block || index_block > data_block || data_block >= sb_bdev_nr_blocks(sb) || (index_block - desc_block) * fsi->descs_per_block < sb_bdev_nr_blocks(sb) - data_block){
+	printk("%s: inconsistent layout, descriptor table %llu+%llu, index %llu+%llu, data from %llu\n", MOD_NAME, desc_block, index_block - desc_block, index_block, data_block - index_block, data_block);
+	return -EINVAL;
+    }
+    fsi->nr_data_blocks = sb_bdev_nr_blocks(sb) - data_block;
+    fsi->ring = flags & SINGLEFILEFS_FLAG_RING;
+    fsi->compress = flags & SINGLEFILEFS_FLAG_COMPRESS;
+
+    //the streams are merged by timestamp, a ring would drop the records of one stream only
+    if(nr_streams > SINGLEFILEFS_MAX_STREAMS || nr_streams > fsi->nr_data_blocks || (nr_streams > 1 && (fsi->ring || fsi->compress)) || (fsi->ring && fsi->compress)){
+	printk("%s: unsupported layout, %llu streams%s%s\n", MOD_NAME, nr_streams, fsi->ring ? " in ring mode" : "", fsi->compress ? " compressed" : "");
+	return -EINVAL;
+    }
+    fsi->nr_streams = nr_streams;
+
+    //every stream gets the same share of contiguous data blocks, the remainder stays unused
+    for (i = 0; i < fsi->nr_streams; i++){
+        st = &fsi->streams[i];
+        st->fsi = fsi;
+        st->id = i;
+        st->nr_blocks = fsi->nr_data_blocks / fsi->nr_streams;
+        st->first_slot = i * st->nr_blocks;
+        st->capacity = (loff_t)st->nr_blocks << sb->s_blocksize_bits;
+        st->max_size = fsi->ring ? MAX_LFS_FILESIZE : st->capacity;
+        mutex_init(&st->ring_mutex);
+        init_waitqueue_head(&st->commit_wq);
+        spin_lock_init(&st->size_lock);
+        INIT_LIST_HEAD(&st->pending);
+        mutex_init(&st->commit_mutex);
+        if (fsi->compress){
+            ret = onefilefs_segments_init(st);
+            if (ret)
+                return ret;
+        }
+
+        //the file size is the checkpoint plus what the recovery scan finds after it
+        st->checkpoint = min_t(loff_t, checkpoint[i], st->max_size);
+        st->records = records[i];
+        st->committed = st->durable = singlefilefs_recover(sb, st, st->checkpoint, &st->records);
+        st->durable_records = st->records;
+        atomic64_set(&st->tail, st->committed);
+        if (fsi->ring)
+            st->head = singlefilefs_ring_head(sb, st, head[i], st->committed);
+        ret = onefilefs_index_init(st);
+        if (ret)
+            return ret;
+    }
+
+    //the data blocks read here go through the page cache of the files from now on
+    invalidate_bdev(sb->s_bdev);
+
+    //in compressed mode max_size only bounds the staging area
+    sb->s_maxbytes = fsi->compress ? MAX_LFS_FILESIZE : fsi->streams[0].max_size;
     sb->s_op = &singlefilefs_super_ops;//set our own operations
 
 
@@ -88,7 +306,18 @@ int singlefilefs_fill_super(struct super_block *sb, void *data, int silent) {
 }
 
 static void singlefilefs_kill_superblock(struct super_block *s) {
+    struct onefilefs_fs_info *fsi = ONEFILEFS_SB(s);
+    unsigned int i;
+
+    //no more appends, the last group commit is done by sync_fs while unmounting
+    if (fsi)
+        cancel_delayed_work_sync(&fsi->commit_work);
     kill_block_super(s);
+    for (i = 0; fsi && i < SINGLEFILEFS_MAX_STREAMS; i++){
+        onefilefs_segments_free(&fsi->streams[i]);
+        onefilefs_index_free(&fsi->streams[i]);
+    }
+    kfree(fsi);
     printk(KERN_INFO "%s: singlefilefs unmount succesful.\n",MOD_NAME);
     return;
 }
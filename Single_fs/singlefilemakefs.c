@@ -6,87 +6,319 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <linux/version.h>
 #include "singlefilefs.h"
 
 /*
 	This makefs will write the following information onto the disk
 	- BLOCK 0, superblock;
-	- BLOCK 1, inode of the unique file (the inode for root is volatile);
-	- BLOCK 2, ..., datablocks of the unique file 
+	- BLOCK 1, inode of the unique file, or of every stream (the inode for root is volatile);
+	- BLOCK 2, ..., descriptor table, one onefilefs_block_desc per data block;
+	- BLOCK index_block, ..., sparse index, one onefilefs_index_entry per SINGLEFILEFS_INDEX_SIZE
+	  bytes of data (eight times as many in a compressed log), shared out among the streams;
+	- BLOCK data_block, ..., datablocks of the unique file, shared out evenly among the streams
+	Blocks are block_size bytes (-b, default DEFAULT_BLOCK_SIZE). The image is resized to
+	-s bytes when it is a regular file, otherwise the size of the device is used.
+	With -n streams the default content is the first record of stream 0. With -z the first
+	two segments of data blocks are the staging area of the compressed log.
 */
 
+//crc32c as computed by the kernel: seed ~0, no final xor
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+	}
+	return crc;
+}
+
+//parses sizes like 400K, 64M, 8G
+static uint64_t parse_size(const char *arg)
+{
+	char *end;
+	uint64_t size = strtoull(arg, &end, 10);
+
+	switch (*end) {
+	case 'G': case 'g':
+		size <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		size <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		size <<= 10;
+		end++;
+		break;
+	}
+	return *end ? 0 : size;
+}
+
+static void usage(void)
+{
+	printf("Usage: mkfs-singlefilefs [-r] [-s size[K|M|G]] [-b block size] [-n streams] [-z] <device>\n");
+}
+
 int main(int argc, char *argv[])
 {
-	int fd, nbytes;
+	int fd, opt;
 	ssize_t ret;
-	struct onefilefs_sb_info sb;
-	struct onefilefs_inode root_inode;
-	struct onefilefs_inode file_inode;
-	struct onefilefs_dir_record record;
-	char *block_padding;
+	struct stat st;
+	uint64_t nr_blocks, desc_blocks, descs_per_block, data_blocks, stream_blocks, b;
+	uint64_t index_entries, index_blocks, index_block, data_block;
+	uint64_t flags = 0, size = 0, block_size = DEFAULT_BLOCK_SIZE, nr_streams = 1;
+	struct onefilefs_sb_info *sb;
+	struct onefilefs_inode *file_inode;
+	struct onefilefs_block_desc *desc;
+	struct onefilefs_index_entry *entry;
+	struct onefilefs_record rec;
+	struct timespec now;
+	char *block;
 	char *file_body = "Log File: Any attempt to write access will be reported in this file.\n";//this is the default content of the unique file 
+	size_t hdr, body_size;
+
+	while ((opt = getopt(argc, argv, "rs:b:n:z")) != -1) {
+		switch (opt) {
+		case 'r':
+			flags |= SINGLEFILEFS_FLAG_RING;//the oldest blocks are overwritten once the image is full
+			break;
+		case 's':
+			size = parse_size(optarg);
+			if (!size) {
+				printf("Invalid image size %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'b':
+			block_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'z':
+			flags |= SINGLEFILEFS_FLAG_COMPRESS;//full segments are compressed with LZ4 by the kernel
+			break;
+		case 'n':
+			nr_streams = strtoull(optarg, NULL, 10);//stream-0 ... stream-(n-1), merged in the unique file
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
 
-	if (argc != 2) {
-		printf("Usage: mkfs-singlefilefs <device>\n");
+	if (optind != argc - 1) {
+		usage();
 		return -1;
 	}
 
-	fd = open(argv[1], O_RDWR);
+	//the kernel maps a block onto a part of a page: a power of two between 512 bytes and the page size
+	if (block_size < SINGLEFILEFS_MIN_BLOCK_SIZE || block_size > (uint64_t)sysconf(_SC_PAGESIZE) || (block_size & (block_size - 1))) {
+		printf("Invalid block size %lu, a power of two between %d and %ld is expected\n", (unsigned long)block_size, SINGLEFILEFS_MIN_BLOCK_SIZE, sysconf(_SC_PAGESIZE));
+		return -1;
+	}
+
+	if (nr_streams < 1 || nr_streams > SINGLEFILEFS_MAX_STREAMS || (nr_streams > 1 && (flags & SINGLEFILEFS_FLAG_RING))) {
+		printf("Invalid number of streams %lu, between 1 and %d and only in the linear layout\n", (unsigned long)nr_streams, SINGLEFILEFS_MAX_STREAMS);
+		return -1;
+	}
+
+	if ((flags & SINGLEFILEFS_FLAG_COMPRESS) && ((flags & SINGLEFILEFS_FLAG_RING) || nr_streams > 1)) {
+		printf("A compressed log is linear and has a single stream\n");
+		return -1;
+	}
+
+	fd = open(argv[optind], O_RDWR | O_CREAT, 0644);
 	if (fd == -1) {
 		perror("Error opening the device");
 		return -1;
 	}
 
-	//pack the superblock
-	sb.version = 1;//file system version
-	sb.magic = MAGIC;
-	sb.block_size = DEFAULT_BLOCK_SIZE;
+	if (fstat(fd, &st) == -1) {
+		perror("Error reading the size of the device");
+		close(fd);
+		return -1;
+	}
 
-	ret = write(fd, (char *)&sb, sizeof(sb)); //scrittura del superblocco
+	if (S_ISREG(st.st_mode)) {
+		//the image is emptied and resized, the unwritten blocks read as zeroes without taking space
+		if (!size)
+			size = st.st_size;
+		if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+			perror("Error resizing the image");
+			close(fd);
+			return -1;
+		}
+	}
+	else {
+		//a block device: its size, the descriptor table is zeroed below
+		if (!size && (size = lseek(fd, 0, SEEK_END)) == (uint64_t)-1) {
+			perror("Error reading the size of the device");
+			close(fd);
+			return -1;
+		}
+	}
 
-	if (ret != DEFAULT_BLOCK_SIZE) {
-		printf("Bytes written [%d] are not equal to the default block size.\n", (int)ret);
+	//one descriptor per data block: the table takes ceil((blocks - 2) / (descs_per_block + 1)) blocks
+	nr_blocks = size / block_size;
+	descs_per_block = block_size / sizeof(struct onefilefs_block_desc);
+	if (nr_blocks < SINGLEFILEFS_DESC_BLOCK_NUMBER + 2) {
+		printf("The device is too small, %lu blocks.\n", (unsigned long)nr_blocks);
 		close(fd);
-		return ret;
+		return -1;
+	}
+	//the index is sized on the whole image, a compressed log holds more bytes than its blocks
+	index_entries = ((nr_blocks - SINGLEFILEFS_DESC_BLOCK_NUMBER) * block_size >> SINGLEFILEFS_INDEX_SHIFT) * (flags & SINGLEFILEFS_FLAG_COMPRESS ? 8 : 1) + nr_streams;
+	index_blocks = (index_entries * sizeof(struct onefilefs_index_entry) + block_size - 1) / block_size;
+	if (nr_blocks < SINGLEFILEFS_DESC_BLOCK_NUMBER + index_blocks + 2) {
+		printf("The device is too small, %lu blocks.\n", (unsigned long)nr_blocks);
+		close(fd);
+		return -1;
+	}
+	desc_blocks = (nr_blocks - SINGLEFILEFS_DESC_BLOCK_NUMBER - index_blocks + descs_per_block) / (descs_per_block + 1);
+	data_blocks = nr_blocks - SINGLEFILEFS_DESC_BLOCK_NUMBER - index_blocks - desc_blocks;
+	index_block = SINGLEFILEFS_DESC_BLOCK_NUMBER + desc_blocks;
+	data_block = index_block + index_blocks;
+	stream_blocks = data_blocks / nr_streams;
+	//the staging area of a compressed log takes two segments, the packed segments follow
+	if ((flags & SINGLEFILEFS_FLAG_COMPRESS) && stream_blocks <= 2 * (SINGLEFILEFS_SEGMENT_SIZE / block_size)) {
+		printf("The device is too small for a compressed log, more than %d bytes of data blocks are needed.\n", 2 * SINGLEFILEFS_SEGMENT_SIZE);
+		close(fd);
+		return -1;
+	}
+	if (!stream_blocks) {
+		printf("The device is too small for %lu streams.\n", (unsigned long)nr_streams);
+		close(fd);
+		return -1;
+	}
+
+	//in a multi-stream image the default content is a record, as the kernel writes them
+	hdr = nr_streams > 1 ? sizeof(rec) : 0;
+	body_size = hdr + strlen(file_body);
+	if (body_size > block_size) {
+		printf("The default content does not fit in a block of %lu bytes.\n", (unsigned long)block_size);
+		close(fd);
+		return -1;
 	}
+	clock_gettime(CLOCK_REALTIME, &now);
+	rec.ts = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	rec.len = strlen(file_body);
+	rec.magic = SINGLEFILEFS_RECORD_MAGIC;
 
-	printf("Super block written succesfully\n");
+	block = calloc(1, block_size);
+	if (!block) {
+		printf("Allocation of the block buffer has failed.\n");
+		close(fd);
+		return -1;
+	}
+
+	//pack the superblock, only its first block_size bytes are written
+	sb = (struct onefilefs_sb_info *)block;
+	sb->version = SINGLEFILEFS_VERSION;//file system version
+	sb->magic = MAGIC;
+	sb->block_size = block_size;
+	sb->inodes_count = nr_streams;//the unique file or the streams, the root is volatile
+	sb->free_blocks = stream_blocks * nr_streams - 1;//the first data block holds the default content
+	sb->desc_block = SINGLEFILEFS_DESC_BLOCK_NUMBER;
+	sb->desc_blocks = desc_blocks;
+	sb->data_block = data_block;
+	sb->index_block = index_block;
+	sb->index_blocks = index_blocks;
+	sb->checkpoint = body_size;
+	sb->flags = flags;
+	sb->head = 0;
+	sb->nr_streams = nr_streams;
+	sb->stream_checkpoint[0] = body_size;
+	sb->stream_records[0] = 1;
+
+	ret = pwrite(fd, block, block_size, SB_BLOCK_NUMBER * block_size); //scrittura del superblocco
+
+	if (ret != (ssize_t)block_size) {
+		printf("Bytes written [%d] are not equal to the block size.\n", (int)ret);
+		free(block);
+		close(fd);
+		return -1;
+	}
 
-	// write file inode
-	file_inode.mode = S_IFREG;
-	file_inode.inode_no = SINGLEFILEFS_FILE_INODE_NUMBER;
-	file_inode.file_size = strlen(file_body);
-	printf("File size is %ld\n",file_inode.file_size);
+	printf("Super block written succesfully (%s%s layout, %lu blocks of %lu bytes, %lu data blocks, %lu streams)\n",
+	       flags & SINGLEFILEFS_FLAG_COMPRESS ? "compressed " : "", flags & SINGLEFILEFS_FLAG_RING ? "ring" : "linear", (unsigned long)nr_blocks, (unsigned long)block_size, (unsigned long)data_blocks, (unsigned long)nr_streams);
+
+	// write file inode, one per stream
+	memset(block, 0, block_size);
+	for (b = 0; b < nr_streams; b++) {
+		file_inode = (struct onefilefs_inode *)block + b;
+		file_inode->mode = S_IFREG;
+		file_inode->inode_no = nr_streams > 1 ? SINGLEFILEFS_STREAM_INODE_NUMBER + b : SINGLEFILEFS_FILE_INODE_NUMBER;
+		file_inode->data_block_number = data_block + b * stream_blocks;
+		file_inode->file_size = b ? 0 : body_size;
+	}
+	printf("File size is %ld\n",((struct onefilefs_inode *)block)->file_size);
 	fflush(stdout);
-	ret = write(fd, (char *)&file_inode, sizeof(file_inode));
+	ret = pwrite(fd, block, block_size, SINGLEFILEFS_INODES_BLOCK_NUMBER * block_size);
 
-	if (ret != sizeof(root_inode)) {
+	if (ret != (ssize_t)block_size) {
 		printf("The file inode was not written properly.\n");
+		free(block);
 		close(fd);
 		return -1;
 	}
 
 	printf("File inode written succesfully.\n");
-	
-	//padding for block 1
-	nbytes = DEFAULT_BLOCK_SIZE - sizeof(file_inode);
-	block_padding = malloc(nbytes);
 
-	ret = write(fd, block_padding, nbytes); 
+	//write the descriptor table, only the first data block is described
+	for (b = 0; b < desc_blocks; b++) {
+		memset(block, 0, block_size);
+		if (b == 0) {
+			desc = (struct onefilefs_block_desc *)block;
+			desc->seq = 1;
+			desc->used = desc->boundary = body_size;
+			desc->records = 1;
+			desc->crc = crc32c(crc32c(~0U, &rec, hdr), file_body, strlen(file_body));
+		}
+		//a regular file was just emptied, the rest of its table is already zero
+		else if (S_ISREG(st.st_mode))
+			break;
+		ret = pwrite(fd, block, block_size, (SINGLEFILEFS_DESC_BLOCK_NUMBER + b) * block_size);
+		if (ret != (ssize_t)block_size) {
+			printf("Writing the descriptor table has failed.\n");
+			free(block);
+			close(fd);
+			return -1;
+		}
+	}
+	printf("Descriptor table of %lu blocks written succesfully.\n", (unsigned long)desc_blocks);
 
-	if (ret != nbytes) {
-		printf("The padding bytes are not written properly. Retry your mkfs\n");
-		free(block_padding);
-		close(fd);
-		return -1;
+	//write the index, the default content is record 0 of stream 0 and starts interval 0
+	for (b = 0; b < index_blocks; b++) {
+		memset(block, 0, block_size);
+		if (b == 0) {
+			entry = (struct onefilefs_index_entry *)block;
+			entry->interval = 1;
+			entry->seq = 0;
+			entry->ts = rec.ts;
+			entry->off = 0;
+		}
+		else if (S_ISREG(st.st_mode))
+			break;
+		ret = pwrite(fd, block, block_size, (index_block + b) * block_size);
+		if (ret != (ssize_t)block_size) {
+			printf("Writing the index has failed.\n");
+			free(block);
+			close(fd);
+			return -1;
+		}
 	}
-	printf("Padding in the inode block written sucessfully.\n");
+	printf("Index of %lu blocks written succesfully.\n", (unsigned long)index_blocks);
 
 	//write file datablock
-	nbytes = strlen(file_body);
-	ret = write(fd, file_body, nbytes);
-	if (ret != nbytes) {
+	memset(block, 0, block_size);
+	memcpy(block, &rec, hdr);
+	memcpy(block + hdr, file_body, strlen(file_body));
+	ret = pwrite(fd, block, block_size, data_block * block_size);
+	free(block);
+	if (ret != (ssize_t)block_size) {
 		printf("Writing file datablock has failed.\n");
 		close(fd);
 		return -1;
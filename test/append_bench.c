@@ -0,0 +1,63 @@
+#include "./include/client.h"
+#include <time.h>
+/* measures the append throughput of the singlefilefs log file <file> (e.g. a loop mounted
+   image) with 64 B, 4 KB and 1 MB writes, <mb> megabytes are appended for each size*/
+
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char** argv){
+    static const size_t sizes[] = {64, 4096, 1 << 20};
+    char* payload;
+    size_t total, done;
+    double start, elapsed;
+    ssize_t ret;
+    int fd, i;
+
+    if (argc != 3) {
+		fprintf(stderr, "Usage: %s <file> <mb>\n", argv[0]);
+		return 1;
+	}
+    total = (size_t)atoi(argv[2]) << 20;
+
+    payload = malloc(sizes[2]);
+    if(!payload){
+        perror("malloc");
+        return -1;
+    }
+    memset(payload, 'a', sizes[2]);
+    payload[sizes[2] - 1] = '\n';
+
+    fd = open(argv[1], O_WRONLY);
+    if(fd < 0){
+        perror("open");
+        return -1;
+    }
+
+    for(i = 0; i < 3; i++){
+        start = now_ns();
+        for(done = 0; done < total; done += ret){
+            ret = write(fd, payload, sizes[i]);
+            if(ret < 0){
+                perror("write");
+                close(fd);
+                return -1;
+            }
+        }
+        elapsed = now_ns() - start;
+        printf("%7zu B appends: %.1f MB/s, %.0f ns per write()\n", sizes[i],
+               (done / 1048576.0) / (elapsed / 1e9), elapsed / (done / sizes[i]));
+    }
+
+    //appends are cached, include the time to reach the device
+    start = now_ns();
+    fsync(fd);
+    printf("fsync: %.1f ms\n", (now_ns() - start) / 1e6);
+
+    close(fd);
+    free(payload);
+	return 0;
+}
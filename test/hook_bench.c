@@ -0,0 +1,93 @@
+#include "./include/client.h"
+#include <time.h>
+/* measures symlink() and mkdir() throughput in an unprotected directory while the blacklist
+   holds <rules> protected directories (created in <dir>). The reference monitor must be in REC-ON state*/
+
+#define ADD_SYSCALL 156
+#define RM_BULK_SYSCALL 178
+#define BULK 256
+
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char** argv){
+    char pw[256];
+    char work[4096];
+    char path[sizeof(work) + sizeof("/entry")];
+    char* bulk[BULK];
+    int rules, iters, i, j, pw_size, n;
+    double start, elapsed;
+
+    if (argc != 4) {
+		fprintf(stderr, "Usage: %s <dir> <rules> <iterations>\n", argv[0]);
+		return 1;
+	}
+    rules = atoi(argv[2]);
+    iters = atoi(argv[3]);
+
+	printf("enter a password:");
+	scanf("%s", pw);
+	pw_size = strlen(pw);
+
+    //protected directories: all the probes are armed
+    for(i = 0; i < rules; i++){
+        snprintf(path, sizeof(path), "%s/protected_%d", argv[1], i);
+        if(mkdir(path, 0755) < 0 && errno != EEXIST){
+            perror("mkdir");
+            return -1;
+        }
+        if(syscall(ADD_SYSCALL, path, strlen(path), pw, pw_size) < 0){
+            printf("error in adding path %s\n", path);
+            return -1;
+        }
+    }
+
+    //unprotected working directory
+    snprintf(work, sizeof(work), "%s/work", argv[1]);
+    if(mkdir(work, 0755) < 0 && errno != EEXIST){
+        perror("mkdir");
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/entry", work);
+
+    start = now_ns();
+    for(i = 0; i < iters; i++){
+        if(symlink("target", path) < 0){
+            perror("symlink");
+            return -1;
+        }
+        unlink(path);
+    }
+    elapsed = now_ns() - start;
+    printf("rules %d: %.0f symlink()+unlink() per second\n", rules, iters / (elapsed / 1e9));
+
+    start = now_ns();
+    for(i = 0; i < iters; i++){
+        if(mkdir(path, 0755) < 0){
+            perror("mkdir");
+            return -1;
+        }
+        rmdir(path);
+    }
+    elapsed = now_ns() - start;
+    printf("rules %d: %.0f mkdir()+rmdir() per second\n", rules, iters / (elapsed / 1e9));
+    rmdir(work);
+
+    //cleanup
+    for(i = 0; i < rules; i += n){
+        n = rules - i < BULK ? rules - i : BULK;
+        for(j = 0; j < n; j++){
+            bulk[j] = malloc(4096);
+            snprintf(bulk[j], 4096, "%s/protected_%d", argv[1], i + j);
+        }
+        syscall(RM_BULK_SYSCALL, bulk, n, pw, pw_size);
+        for(j = 0; j < n; j++){
+            rmdir(bulk[j]);
+            free(bulk[j]);
+        }
+    }
+	return 0;
+}
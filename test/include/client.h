@@ -6,6 +6,7 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 enum rm_state {
     ON,
     OFF,
@@ -13,4 +14,35 @@ enum rm_state {
     REC_OFF
 };
 
+//filter of the log, same layout as in FSReferenceMonitor/referenceMonitor.h
+struct log_filter_spec {
+    int uid; //-1 any
+    int euid; //-1 any
+    const char* exe; //NULL any
+    const char* rule; //NULL any
+    unsigned int ops; //bitmask of the operations (open, create, link, unlink, symlink, rmdir, mkdir, mknod, rename, setattr), 0 any
+};
+
+//state of the log file, same layout as in Single_fs/singlefilefs.h
+struct onefilefs_log_info {
+    unsigned long long head; //first readable byte, the bytes before it were overwritten in ring mode
+    unsigned long long committed; //size of the log
+    unsigned long long durable; //size of the log known to be on the device
+    unsigned long long capacity; //bytes of the data blocks of the image
+    unsigned long long flags; //1 ring mode
+};
+
+#define ONEFILEFS_IOC_LOG_INFO _IOR(0x42, 1, struct onefilefs_log_info)
+
+//where to start reading for the records from a time or a sequence number on, same layout as in Single_fs/singlefilefs.h
+struct onefilefs_seek {
+    unsigned long long flags; //1 key is a time in ns since the epoch, 2 a sequence number (stream files only)
+    unsigned long long key;
+    unsigned long long off; //offset of a record at or before the first one matching key
+    unsigned long long seq; //sequence number of the record at off
+    unsigned long long ts; //timestamp of the record at off, 0 if not known
+};
+
+#define ONEFILEFS_IOC_SEEK _IOWR(0x42, 2, struct onefilefs_seek)
+
 extern void displayMenu();
\ No newline at end of file
@@ -0,0 +1,61 @@
+#include "./include/client.h"
+/* decodes a log written in dictionary mode (log_mode=1) into the text lines of the default mode.
+   Lines in the text format are copied as they are*/
+
+#define DICT_MAX 4096 //LOG_DICT_MAX of the module
+#define LINE_MAX_LEN (4 * 4096)
+
+static char* dict[DICT_MAX];
+static const char* op_name[] = {"open", "create", "link", "unlink", "symlink", "rmdir", "mkdir", "mknod", "rename", "setattr"}; //enum rm_op
+
+static void dict_reset(){
+    int i;
+
+    for(i = 0; i < DICT_MAX; i++){
+        free(dict[i]);
+        dict[i] = NULL;
+    }
+}
+
+static const char* dict_get(int id){
+    if(id < 0 || id >= DICT_MAX || !dict[id]) return "?";
+    return dict[id];
+}
+
+int main(int argc, char** argv){
+    static char line[LINE_MAX_LEN];
+    const char* path = "./Single_fs/mount/the-file";
+    FILE* log;
+    int id, rule, op, program, digest, tgid, tid, euid, uid, off;
+    char kind;
+
+    if(argc > 2){
+		fprintf(stderr, "Usage: %s [log file]\n", argv[0]);
+		return 1;
+	}
+    if(argc == 2) path = argv[1];
+    log = fopen(path, "r");
+    if(!log){
+        perror("fopen");
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), log)){
+        if(line[0] == 'R' && line[1] == ' '){
+            dict_reset();
+        }else if(line[0] == 'D' && sscanf(line, "D %d %c %n", &id, &kind, &off) == 2){
+            if(id < 0 || id >= DICT_MAX) continue;
+            line[strcspn(line, "\n")] = '\0';
+            free(dict[id]);
+            dict[id] = strdup(line + off);
+        }else if(line[0] == 'E' && sscanf(line, "E %d %d %d %d %d %d %d %d", &rule, &op, &program, &digest, &tgid, &tid, &euid, &uid) == 8){
+            printf("pathname: %s, operation: %s, program: %s, file content hash: %s, tgid: %d, tid: %d, effective uid: %d, real uid: %d\n",
+                    dict_get(rule), op >= 0 && op < 10 ? op_name[op] : "?", dict_get(program), dict_get(digest), tgid, tid, euid, uid);
+        }else{
+            fputs(line, stdout);
+        }
+    }
+    dict_reset();
+    fclose(log);
+	return 0;
+}
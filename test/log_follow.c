@@ -0,0 +1,43 @@
+#include "./include/client.h"
+#include <poll.h>
+/* prints the log file <file> and then the records appended to it as they are committed,
+   sleeping in poll until the kernel reports new bytes */
+
+int main(int argc, char** argv){
+    struct pollfd pfd;
+    char buf[4096];
+    ssize_t n;
+    int fd;
+
+    if (argc != 2) {
+		fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+		return 1;
+	}
+
+    fd = open(argv[1], O_RDONLY);
+    if(fd < 0){
+        perror("open");
+        return -1;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    for (;;) {
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            fwrite(buf, 1, n, stdout);
+            fflush(stdout);
+        }
+        if (n < 0) {
+            perror("read");
+            break;
+        }
+        //end of the committed log: wait for the next append
+        if (poll(&pfd, 1, -1) < 0) {
+            perror("poll");
+            break;
+        }
+    }
+
+    close(fd);
+	return -1;
+}
@@ -0,0 +1,31 @@
+#include "./include/client.h"
+/* prints the state of the log file <file>: size, durable part, capacity of the image and,
+   in ring mode, the bytes lost because they were overwritten */
+
+int main(int argc, char** argv){
+    struct onefilefs_log_info info;
+    int fd;
+
+    if (argc != 2) {
+		fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+		return 1;
+	}
+
+    fd = open(argv[1], O_RDONLY);
+    if(fd < 0){
+        perror("open");
+        return -1;
+    }
+    if(ioctl(fd, ONEFILEFS_IOC_LOG_INFO, &info) < 0){
+        perror("ioctl");
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    printf("layout: %s%s\n", info.flags & 2 ? "compressed " : "", info.flags & 1 ? "ring" : "linear");
+    printf("size: %llu bytes (%llu on the device)\n", info.committed, info.durable);
+    printf("capacity: %llu bytes\n", info.capacity);
+    printf("lost: %llu bytes, the log is readable from offset %llu\n", info.head, info.head);
+	return 0;
+}
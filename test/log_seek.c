@@ -0,0 +1,49 @@
+#include "./include/client.h"
+/* prints the log file <file> from the first record appended at or after a time (-t, seconds
+   since the epoch) or from a sequence number (-s), the kernel finds where to start through
+   the sparse index of the image */
+
+int main(int argc, char** argv){
+    struct onefilefs_seek q;
+    char buf[4096];
+    ssize_t n;
+    int fd;
+
+    if (argc != 4 || (strcmp(argv[2], "-t") && strcmp(argv[2], "-s"))) {
+		fprintf(stderr, "Usage: %s <file> -t <unix seconds> | -s <seq>\n", argv[0]);
+		return 1;
+	}
+
+    memset(&q, 0, sizeof(q));
+    q.key = strtoull(argv[3], NULL, 10);
+    if (argv[2][1] == 't') {
+        q.flags = 1;
+        q.key *= 1000000000ULL;
+    }
+    else
+        q.flags = 2;
+
+    fd = open(argv[1], O_RDONLY);
+    if(fd < 0){
+        perror("open");
+        return -1;
+    }
+    if(ioctl(fd, ONEFILEFS_IOC_SEEK, &q) < 0){
+        perror("ioctl");
+        close(fd);
+        return -1;
+    }
+    fprintf(stderr, "record %llu at offset %llu\n", q.seq, q.off);
+
+    if(lseek(fd, q.off, SEEK_SET) < 0){
+        perror("lseek");
+        close(fd);
+        return -1;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, n, stdout);
+    if (n < 0)
+        perror("read");
+    close(fd);
+	return n < 0 ? -1 : 0;
+}
@@ -0,0 +1,85 @@
+#include "./include/client.h"
+#include <time.h>
+/* measures the cost of a write-open of an unprotected file while the blacklist holds
+   <rules> protected files (created in <dir>). The reference monitor must be in REC-ON state*/
+
+#define ADD_SYSCALL 156
+#define RM_BULK_SYSCALL 178
+#define BULK 256
+
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char** argv){
+    char pw[256];
+    char path[4096];
+    char* bulk[BULK];
+    int rules, iters, i, j, fd, pw_size, n;
+    double start, elapsed;
+
+    if (argc != 4) {
+		fprintf(stderr, "Usage: %s <dir> <rules> <iterations>\n", argv[0]);
+		return 1;
+	}
+    rules = atoi(argv[2]);
+    iters = atoi(argv[3]);
+
+	printf("enter a password:");
+	scanf("%s", pw);
+	pw_size = strlen(pw);
+
+    //protected files
+    for(i = 0; i < rules; i++){
+        snprintf(path, sizeof(path), "%s/protected_%d", argv[1], i);
+        fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if(fd < 0){
+            perror("open");
+            return -1;
+        }
+        close(fd);
+        if(syscall(ADD_SYSCALL, path, strlen(path), pw, pw_size) < 0){
+            printf("error in adding path %s\n", path);
+            return -1;
+        }
+    }
+
+    //unprotected target
+    snprintf(path, sizeof(path), "%s/unprotected", argv[1]);
+    fd = open(path, O_CREAT | O_WRONLY, 0644);
+    if(fd < 0){
+        perror("open");
+        return -1;
+    }
+    close(fd);
+
+    start = now_ns();
+    for(i = 0; i < iters; i++){
+        fd = open(path, O_WRONLY);
+        if(fd < 0){
+            perror("open");
+            return -1;
+        }
+        close(fd);
+    }
+    elapsed = now_ns() - start;
+    printf("rules %d: %.1f ns per open()+close() of an unprotected file\n", rules, elapsed / iters);
+    unlink(path);
+
+    //cleanup
+    for(i = 0; i < rules; i += n){
+        n = rules - i < BULK ? rules - i : BULK;
+        for(j = 0; j < n; j++){
+            bulk[j] = malloc(4096);
+            snprintf(bulk[j], 4096, "%s/protected_%d", argv[1], i + j);
+        }
+        syscall(RM_BULK_SYSCALL, bulk, n, pw, pw_size);
+        for(j = 0; j < n; j++){
+            unlink(bulk[j]);
+            free(bulk[j]);
+        }
+    }
+	return 0;
+}
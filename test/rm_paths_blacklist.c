@@ -0,0 +1,24 @@
+#include "./include/client.h"
+/* remove a set of paths from the blacklist with a single system call*/
+
+int main(int argc, char** argv){
+	int ret ;
+	char pw[256];
+	int pw_size;
+
+	int syscall_index = 178;
+    if (argc < 2) {
+		fprintf(stderr, "Usage: %s <path file> [<path file> ...]\n", argv[0]);
+		return 1;
+	}
+	printf("enter a password:");
+    scanf("%s", pw);
+    pw_size = strlen(pw);
+    ret = syscall(syscall_index, &argv[1], argc - 1, pw, pw_size);
+    if(ret < 0){
+        printf("error in removing paths\n");
+        return -1;
+    }
+    printf("%d paths removed\n", ret);
+	return 0;
+}
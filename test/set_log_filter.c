@@ -0,0 +1,79 @@
+#include "./include/client.h"
+/* replaces the filters of the log: each argument is a filter made of comma separated fields
+   uid=<uid>,euid=<uid>,exe=<program path>,rule=<protected path>,ops=<op>+<op>...
+   A denial matching all the fields of a filter is not logged. Without arguments the filters are removed*/
+
+#define MAX_FILTERS 32
+
+static const char* op_name[] = {"open", "create", "link", "unlink", "symlink", "rmdir", "mkdir", "mknod", "rename", "setattr"};
+
+static int parse_ops(char* ops){
+    char* op;
+    unsigned int i, mask = 0;
+
+    for(op = strtok(ops, "+"); op; op = strtok(NULL, "+")){
+        for(i = 0; i < sizeof(op_name) / sizeof(op_name[0]); i++)
+            if(!strcmp(op, op_name[i])) break;
+        if(i == sizeof(op_name) / sizeof(op_name[0])){
+            fprintf(stderr, "unknown operation %s\n", op);
+            return -1;
+        }
+        mask |= 1U << i;
+    }
+    return mask;
+}
+
+static int parse_filter(char* arg, struct log_filter_spec* spec){
+    char *field, *save, *value;
+    int ops;
+
+    spec->uid = -1;
+    spec->euid = -1;
+    spec->exe = NULL;
+    spec->rule = NULL;
+    spec->ops = 0;
+    for(field = strtok_r(arg, ",", &save); field; field = strtok_r(NULL, ",", &save)){
+        value = strchr(field, '=');
+        if(!value) return -1;
+        *value++ = '\0';
+        if(!strcmp(field, "uid")) spec->uid = atoi(value);
+        else if(!strcmp(field, "euid")) spec->euid = atoi(value);
+        else if(!strcmp(field, "exe")) spec->exe = value;
+        else if(!strcmp(field, "rule")) spec->rule = value;
+        else if(!strcmp(field, "ops")){
+            ops = parse_ops(value);
+            if(ops < 0) return -1;
+            spec->ops = ops;
+        }
+        else return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv){
+	int ret, i;
+	char pw[256];
+	int pw_size;
+    struct log_filter_spec specs[MAX_FILTERS];
+
+	int syscall_index = 180;
+    if (argc - 1 > MAX_FILTERS) {
+		fprintf(stderr, "Usage: %s [uid=<uid>,euid=<uid>,exe=<path>,rule=<path>,ops=<op>+<op> ...]\n", argv[0]);
+		return 1;
+	}
+    for(i = 1; i < argc; i++){
+        if(parse_filter(argv[i], &specs[i - 1]) < 0){
+            fprintf(stderr, "invalid filter %s\n", argv[i]);
+            return 1;
+        }
+    }
+	printf("enter a password:");
+    scanf("%s", pw);
+    pw_size = strlen(pw);
+    ret = syscall(syscall_index, argc > 1 ? specs : NULL, argc - 1, pw, pw_size);
+    if(ret < 0){
+        printf("error in setting the log filters\n");
+        return -1;
+    }
+	return 0;
+}